@@ -12,7 +12,11 @@ void keep_running()
     std::getchar();
 }
 
-int main()
+/**
+ * \brief Passing a unix socket path as the first argument enables hot restarts:
+ * start a second process with the same path and it takes over the listening socket while this one drains and exits.
+ */
+int main(int argc, char *argv[])
 {
     try
     {
@@ -20,6 +24,17 @@ int main()
 
         // Create a web_server which will listen on port 80 on the localhost.
         web_server ws("127.0.0.1", 4445, "cert.pem", "key.pem");
+#ifndef _WIN32
+        const std::string handoff_path = argc > 1 ? argv[1] : "";
+        if (!handoff_path.empty())
+        {
+            // If another process is running it hands us its listening socket, otherwise we use our own.
+            ws.adopt_listener(handoff_path);
+            ws.serve_listener_handoff(handoff_path);
+        }
+        // Local clients (sidecars) can skip the TCP stack and the TLS handshake by connecting to this socket instead.
+        ws.add_unix_listener("/tmp/web_server.sock");
+#endif
         // We can start it immediately.
         ws.start();
         // We can add endpoints at runtime (which some libraries can't do)
@@ -57,11 +72,20 @@ int main()
             });
 
         // This thread is only to keep the server from closing until we enter a character.
-        std::thread t([]() { keep_running(); });
+        std::atomic<bool> keep_going = true;
+        std::thread t(
+            [&]()
+            {
+                keep_running();
+                keep_going = false;
+            });
+        t.detach();
 
-        t.join();
+        while (keep_going && !ws.handed_off())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         // It is VERY important to call the stop function to exit cleanly.
-        ws.stop();
+        // Requests that are busy get 5 seconds to finish.
+        ws.stop(std::chrono::seconds(5));
     }
     catch (const std::exception &e)
     {
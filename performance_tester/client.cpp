@@ -5,8 +5,19 @@
 
 client::client(const std::string &ip_address, unsigned short port)
 {
-    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(ip_address), port);
-    _socket = std::make_unique<asio::ip::tcp::socket>(_context);
+    run(asio::ip::tcp::endpoint(asio::ip::make_address(ip_address), port));
+}
+
+#ifndef _WIN32
+client::client(const asio::local::stream_protocol::endpoint &endpoint)
+{
+    run(endpoint);
+}
+#endif
+
+void client::run(const asio::generic::stream_protocol::endpoint &endpoint)
+{
+    _socket = std::make_unique<asio::generic::stream_protocol::socket>(_context);
 
     _socket->connect(endpoint);
 
@@ -15,16 +15,27 @@ class client
      * \param port The port the server is listening on. Usually port 80.
      */
     client(const std::string &ip_address, unsigned short port = 80);
+#ifndef _WIN32
+    /**
+     * \brief Connects to a unix domain socket and does a GET request.
+     * \param endpoint The socket the server is listening on.
+     */
+    explicit client(const asio::local::stream_protocol::endpoint &endpoint);
+#endif
     ~client() = default;
 
   private:
+    /**
+     * \brief Connects to the endpoint and does the GET request.
+     */
+    void run(const asio::generic::stream_protocol::endpoint &endpoint);
     /**
      * \brief Writes the GET request to the socket.
      */
     void write_header();
 
     asio::io_context _context;
-    std::unique_ptr<asio::ip::tcp::socket> _socket = nullptr;
+    std::unique_ptr<asio::generic::stream_protocol::socket> _socket = nullptr;
     std::vector<unsigned char> _response;
     std::string _request;
     bool still_running = true;
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <iostream>
 #include <numeric>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -28,10 +29,74 @@ void print_average_times_for_last_second()
     }
 }
 
-int main()
+/**
+ * \brief Sends requests from number_of_clients threads for duration and prints the throughput and latency.
+ * \param name What is being measured.
+ * \param do_request Connects, does one request and disconnects.
+ */
+template <typename Request>
+void benchmark(const std::string &name, const int number_of_clients, const std::chrono::seconds duration,
+    const Request &do_request)
+{
+    std::vector<std::vector<int>> times(number_of_clients);
+    std::vector<std::thread> clients;
+    const auto end_time = std::chrono::steady_clock::now() + duration;
+
+    for (auto i = 0; i < number_of_clients; i++)
+    {
+        clients.emplace_back(
+            [&, i]()
+            {
+                while (std::chrono::steady_clock::now() < end_time)
+                {
+                    const auto start_time = std::chrono::steady_clock::now();
+                    do_request();
+                    times[i].push_back(static_cast<int>(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start_time)
+                                                            .count()));
+                }
+            });
+    }
+    for (auto &t : clients)
+        t.join();
+
+    std::vector<int> all_times;
+    for (const auto &thread_times : times)
+        all_times.insert(all_times.end(), thread_times.begin(), thread_times.end());
+    if (all_times.empty())
+        return;
+    std::sort(all_times.begin(), all_times.end());
+
+    const auto sum = std::accumulate(all_times.begin(), all_times.end(), 0.0);
+    std::cout << name << ": " << static_cast<double>(all_times.size()) / static_cast<double>(duration.count())
+              << " requests per second, average " << sum / static_cast<double>(all_times.size())
+              << " microseconds, p50 " << all_times[all_times.size() / 2] << ", p99 "
+              << all_times[all_times.size() * 99 / 100] << '\n';
+}
+
+/**
+ * \brief Without arguments the root of 127.0.0.1:80 is hit until a character is entered.
+ * With "compare <port> <unix socket path> [seconds]" loopback TCP and the unix domain socket are measured one after
+ * the other.
+ */
+int main(int argc, char *argv[])
 {
     const auto number_of_clients = 16;
 
+#ifndef _WIN32
+    if (argc >= 4 && std::string(argv[1]) == "compare")
+    {
+        const auto port = static_cast<unsigned short>(std::stoi(argv[2]));
+        const std::string unix_socket_path = argv[3];
+        const auto duration = std::chrono::seconds(argc >= 5 ? std::stoi(argv[4]) : 5);
+
+        benchmark("loopback TCP", number_of_clients, duration, [&]() { client c("127.0.0.1", port); });
+        benchmark("unix domain socket", number_of_clients, duration,
+            [&]() { client c{asio::local::stream_protocol::endpoint(unix_socket_path)}; });
+        return 0;
+    }
+#endif
+
     std::thread performance_print_thread([&]() { print_average_times_for_last_second(); });
 
     std::vector<std::thread> clients(number_of_clients);
@@ -44,7 +109,7 @@ int main()
                 while (!SHUTDOWN)
                 {
                     const auto start_time = std::chrono::high_resolution_clock::now();
-                    client c("127.0.0.1");
+                    client c(std::string("127.0.0.1"));
                     times_.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
                         std::chrono::high_resolution_clock::now() - start_time)
                                          .count());
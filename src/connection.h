@@ -5,23 +5,53 @@
 #include <asio/ssl.hpp>
 #endif
 
+#include "multipart_parser.h"
+#include "response_stream.h"
 #include "structs/request.h"
 #include "structs/response.h"
 
+#ifdef REQUEST_TRACING
+#include "request_tracer.h"
+#define TRACE_PHASE(trace, phase) (trace).mark(TRACE_PHASES::phase)
+#else
+#define TRACE_PHASE(trace, phase)
+#endif
+
+/**
+ * \brief Sent when the body can't be parsed, without calling a handler.
+ */
+inline const std::string bad_request_response = "HTTP/1.1 400 Bad Request\r\n"
+                                                "Content-Type: text/plain\r\n"
+                                                "Content-Length: 11\r\n"
+                                                "Connection: close\r\n\r\n"
+                                                "Bad Request";
+
 /**
  * \brief This class is responsible for reading and writing to the socket.
  */
 class connection : public std::enable_shared_from_this<connection>
 {
   public:
+    /**
+     * \brief TCP and unix domain sockets are both converted to this so that they are served the same way.
+     */
+    using socket_type = asio::generic::stream_protocol::socket;
+
     /**
      * \brief This class moves the socket locally and is responsible to read and write to it.
      * \param socket the socket is moved to this class
+     * \param remote_address the ip-address of the client, it is copied into every web_request.
+     * \param peer the credentials of the process on the other side of a unix domain socket.
      */
 #ifdef OPEN_SSL
-    connection(asio::ssl::stream<asio::ip::tcp::socket> socket);
+    /**
+     * \param tls false to skip the handshake and serve the connection in plaintext, used for unix domain sockets.
+     */
+    connection(asio::ssl::stream<socket_type> socket, std::string remote_address = "",
+        std::optional<peer_credentials> peer = std::nullopt, bool tls = true);
 #else
-    connection(asio::ip::tcp::socket socket);
+    connection(
+        socket_type socket, std::string remote_address = "", std::optional<peer_credentials> peer = std::nullopt);
 #endif
 
     connection(const connection &c) = delete;
@@ -35,19 +65,62 @@ class connection : public std::enable_shared_from_this<connection>
      * This is to allow the server to call a function set by the end user.
      */
     std::function<void(web_request &, web_response &)> done_reading_function;
+    /**
+     * \brief Called as soon as the header has been read, before the body is read.
+     * If it returns a preserialized response, that response is written instead of calling done_reading_function.
+     * The returned string must outlive the connection.
+     */
+    std::function<const std::string *(const web_request &)> reject_function;
+#ifdef REQUEST_TRACING
+    /**
+     * \brief Called with the timestamps of every phase once the response has been written.
+     */
+    std::function<void(const request_trace &)> trace_function;
+#endif
     /**
      * \brief This will be set to true so that the connection can be deleted from the web_server class.
+     * It is set on the context thread and read by the web_server's cleanup thread and by stop().
      */
-    bool close_me = false;
+    std::atomic<bool> close_me = false;
+
+    /**
+     * \brief Closes the connection if it is still waiting for a request, used when the server drains.
+     * Connections that are busy with a request are left to finish.
+     * Must be called from the context thread.
+     */
+    void close_if_idle();
+    /**
+     * \brief Ends a streamed response that is still open, used when the server drains.
+     * The end is sent once the write that is in flight has completed and later writes from the handler fail.
+     * Must be called from the context thread.
+     */
+    void close_stream();
+    /**
+     * \brief Stops a streamed response from using the socket, used right before the context is stopped.
+     * Writes from a handler that kept the stream fail from then on instead of posting to a stopped context.
+     * Can be called from any thread.
+     */
+    void abort_stream();
 
   protected:
 #ifdef OPEN_SSL
-    asio::ssl::stream<asio::ip::tcp::socket> _socket;
+    asio::ssl::stream<socket_type> _socket;
+    /**
+     * \brief false if the connection is served in plaintext over the socket under the TLS stream.
+     */
+    bool _tls;
 #else
-    asio::ip::tcp::socket _socket;
+    socket_type _socket;
 #endif
 
   private:
+    /**
+     * \brief Calls operation with the stream to read from and write to: the TLS stream, or the socket under it when the
+     * connection is served in plaintext.
+     */
+    template <typename Operation>
+    void on_stream(Operation &&operation);
+
     /**
      * \brief This is the first function that is called to get the request header.
      * It happens directly after a connection is established.
@@ -56,9 +129,20 @@ class connection : public std::enable_shared_from_this<connection>
 
     /**
      * \brief Adds the body to the web_request object.
+     * multipart/form-data bodies are handed to read_multipart_body instead.
      */
     void read_body();
 
+    /**
+     * \brief Feeds the body to the multipart parser as it arrives, so the whole upload is never in memory at once.
+     */
+    void read_multipart_body();
+
+    /**
+     * \brief Closes the socket after a failed read.
+     */
+    void handle_read_error(const std::error_code &ec);
+
     /**
      * \brief Sets the header content that was sent.
      * \param header The string of headers that was sent from the client.
@@ -66,6 +150,27 @@ class connection : public std::enable_shared_from_this<connection>
      */
     static void header_helper(std::string &header, web_request &request_header);
     void call_function_write_response();
+    /**
+     * \brief Writes a response that was serialized up front and closes the connection.
+     * \param response Must stay alive until the write has completed.
+     */
+    void write_preserialized_response(const std::string &response);
+    /**
+     * \brief Writes the header of a streamed response and hands a response_stream to the handler.
+     * The connection stays in the server's list until the stream has ended, the stream itself only refers to it weakly.
+     */
+    void start_stream(web_response &response);
+    /**
+     * \brief Lets the client know the response is complete and marks the connection to be deleted.
+     * Must be called from the context thread.
+     */
+    void response_written();
+    /**
+     * \brief Posts function to the context if the streamed response is still open.
+     * \param last Closes the stream so that nothing else is posted.
+     * \return false if the stream was already closed or aborted.
+     */
+    bool post_to_stream(std::function<void()> function, bool last = false);
 #ifdef OPEN_SSL
     void do_handshake();
     void ssl_shutdown(const asio::error_code &ec);
@@ -74,78 +179,228 @@ class connection : public std::enable_shared_from_this<connection>
     asio::streambuf _socket_buffer;
     std::string _response_string;
     long _body_length;
+    /**
+     * \brief How much of a multipart body still has to be read from the socket.
+     */
+    std::size_t _body_remaining = 0;
+    std::unique_ptr<multipart_parser> _multipart_parser;
+    /**
+     * \brief Set once the header has been read, from then on the connection is busy until the response is written.
+     */
+    bool _in_flight = false;
+    /**
+     * \brief Guards _stream_open and _stream, handlers write to the stream from their own threads and stop() aborts it
+     * from the caller's thread.
+     */
+    std::mutex _stream_mutex;
+    /**
+     * \brief True from the moment the stream is handed to the handler until the response has ended or was aborted.
+     */
+    bool _stream_open = false;
+    /**
+     * \brief Set when the server drains before the stream was handed to the handler.
+     */
+    bool _close_stream_when_open = false;
+    std::weak_ptr<response_stream> _stream;
     web_request _request_header{};
+#ifdef REQUEST_TRACING
+    request_trace _trace;
+
+    void finish_trace();
+#endif
 };
 
 #ifdef OPEN_SSL
-inline connection::connection(asio::ssl::stream<asio::ip::tcp::socket> socket)
-    : _socket(std::move(socket)), _body_length(-1)
+inline connection::connection(asio::ssl::stream<socket_type> socket, std::string remote_address,
+    std::optional<peer_credentials> peer, const bool tls)
+    : _socket(std::move(socket)), _tls(tls), _body_length(-1)
 {
-    do_handshake();
+    TRACE_PHASE(_trace, ACCEPTED);
+    _request_header.remote_address = std::move(remote_address);
+    _request_header.peer = peer;
+    if (_tls)
+        do_handshake();
+    else
+        read_header();
 }
 #else
-inline connection::connection(asio::ip::tcp::socket socket) : _socket(std::move(socket)), _body_length(-1)
+inline connection::connection(socket_type socket, std::string remote_address, std::optional<peer_credentials> peer)
+    : _socket(std::move(socket)), _body_length(-1)
 {
+    TRACE_PHASE(_trace, ACCEPTED);
+    _request_header.remote_address = std::move(remote_address);
+    _request_header.peer = peer;
     read_header();
 }
 #endif
 
+template <typename Operation>
+inline void connection::on_stream(Operation &&operation)
+{
+#ifdef OPEN_SSL
+    if (_tls)
+        operation(_socket);
+    else
+        operation(_socket.next_layer());
+#else
+    operation(_socket);
+#endif
+}
+
 inline void connection::read_header()
 {
-    async_read_until(_socket, _socket_buffer, "\r\n\r\n",
-        [&](const std::error_code ec, const std::size_t length_read)
+    auto on_read = [&](const std::error_code ec, const std::size_t length_read)
+    {
+        // We have read some data.
+        if (!ec)
         {
-            // We have read some data.
-            if (!ec)
+            if (length_read != 0)
             {
-                if (length_read != 0)
-                {
-                    auto header = std::string(asio::buffer_cast<const char *>(_socket_buffer.data()), length_read);
-                    _socket_buffer.consume(length_read);
+                TRACE_PHASE(_trace, READ_HEADER);
+                _in_flight = true;
+                auto header = std::string(asio::buffer_cast<const char *>(_socket_buffer.data()), length_read);
+                _socket_buffer.consume(length_read);
 
-                    header_helper(header, _request_header);
+                header_helper(header, _request_header);
+#ifdef REQUEST_TRACING
+                _trace.method = _request_header.method;
+                _trace.url = _request_header.url;
+#endif
 
-                    if (_request_header.header_values.find("Content-Length") != _request_header.header_values.end())
+                if (_request_header.header_values.find("Content-Length") != _request_header.header_values.end())
+                {
+                    _body_length = std::stol(_request_header.header_values["Content-Length"]);
+                }
+
+                if (reject_function)
+                {
+                    if (const auto *rejection = reject_function(_request_header))
                     {
-                        _body_length = std::stol(_request_header.header_values["Content-Length"]);
+                        write_preserialized_response(*rejection);
+                        return;
                     }
-
-                    read_body();
                 }
+
+                read_body();
             }
-            else
-            {
-                std::cerr << "[connection] Error: " << ec.message() << std::endl;
-#ifdef OPEN_SSL
-                _socket.lowest_layer().cancel();
-                _socket.async_shutdown([&](const asio::error_code &err_c) { this->ssl_shutdown(err_c); });
-#else
-                _socket.close();
-#endif
-                close_me = true;
-            }
-        });
+        }
+        else
+        {
+            handle_read_error(ec);
+        }
+    };
+    on_stream([&](auto &stream) { async_read_until(stream, _socket_buffer, "\r\n\r\n", on_read); });
 }
 
 inline void connection::read_body()
 {
     if (_body_length > 0)
     {
-        async_read_until(_socket, _socket_buffer, "}",
-            [&](const std::error_code ec, const std::size_t length_read)
+        const auto content_type = _request_header.header_values.find("Content-Type");
+        const auto boundary = content_type == _request_header.header_values.end()
+                                  ? std::string()
+                                  : multipart_parser::boundary_from_content_type(content_type->second);
+        if (!boundary.empty())
+        {
+            _multipart_parser = std::make_unique<multipart_parser>(boundary);
+            _body_remaining = static_cast<std::size_t>(_body_length);
+            read_multipart_body();
+            return;
+        }
+
+        const auto body_length = static_cast<std::size_t>(_body_length);
+        const auto buffered = _socket_buffer.size();
+        auto on_read = [&, body_length](const std::error_code ec, const std::size_t)
+        {
+            if (ec)
             {
-                const auto body = std::string(asio::buffer_cast<const char *>(_socket_buffer.data()), _body_length);
+                handle_read_error(ec);
+                return;
+            }
 
-                _request_header.body = body;
-                call_function_write_response();
-                close_me = true;
+            _request_header.body = std::string(asio::buffer_cast<const char *>(_socket_buffer.data()), body_length);
+            _socket_buffer.consume(body_length);
+            TRACE_PHASE(_trace, READ_BODY);
+            call_function_write_response();
+        };
+        on_stream(
+            [&](auto &stream)
+            {
+                async_read(stream, _socket_buffer,
+                    asio::transfer_exactly(buffered >= body_length ? 0 : body_length - buffered), on_read);
             });
     }
     else
     {
+        TRACE_PHASE(_trace, READ_BODY);
+        call_function_write_response();
+    }
+}
+
+inline void connection::read_multipart_body()
+{
+    const auto available = std::min(_socket_buffer.size(), _body_remaining);
+    if (available > 0)
+    {
+        const auto fed = _multipart_parser->feed(
+            std::string_view(asio::buffer_cast<const char *>(_socket_buffer.data()), available));
+        _socket_buffer.consume(available);
+        _body_remaining -= available;
+        if (!fed)
+        {
+            _multipart_parser.reset();
+            write_preserialized_response(bad_request_response);
+            return;
+        }
+    }
+
+    if (_body_remaining == 0)
+    {
+        if (!_multipart_parser->done())
+        {
+            _multipart_parser.reset();
+            write_preserialized_response(bad_request_response);
+            return;
+        }
+
+        _request_header.parts = std::move(_multipart_parser->parts());
+        _multipart_parser.reset();
+        TRACE_PHASE(_trace, READ_BODY);
         call_function_write_response();
+        return;
+    }
+
+    constexpr std::size_t read_size = 64 * 1024;
+    auto on_read = [&](const std::error_code ec, const std::size_t length_read)
+    {
+        if (ec)
+        {
+            handle_read_error(ec);
+            return;
+        }
+
+        _socket_buffer.commit(length_read);
+        read_multipart_body();
+    };
+    on_stream([&](auto &stream)
+        { stream.async_read_some(_socket_buffer.prepare(std::min(_body_remaining, read_size)), on_read); });
+}
+
+inline void connection::handle_read_error(const std::error_code &ec)
+{
+    if (ec != asio::error::operation_aborted)
+        std::cerr << "[connection] Error: " << ec.message() << std::endl;
+#ifdef OPEN_SSL
+    if (_tls)
+    {
+        _socket.lowest_layer().cancel();
+        _socket.async_shutdown([&](const asio::error_code &err_c) { this->ssl_shutdown(err_c); });
         close_me = true;
+        return;
     }
+#endif
+    _socket.lowest_layer().close();
+    close_me = true;
 }
 
 inline void connection::header_helper(std::string &header, web_request &request_header)
@@ -193,14 +448,154 @@ inline void connection::call_function_write_response()
     response.version = _request_header.version;
     response.host = _request_header.header_values["Host"];
     done_reading_function(_request_header, response);
+    TRACE_PHASE(_trace, HANDLER);
+    if (response.stream_function)
+    {
+        start_stream(response);
+        return;
+    }
+
     _response_string = response.to_string();
-    async_write(_socket, asio::buffer(_response_string, _response_string.length()),
-        [&](const std::error_code ec_write, const std::size_t bytes_written)
+    auto on_written = [&](const std::error_code ec_write, const std::size_t bytes_written)
+    {
+        if (ec_write || bytes_written != _response_string.length())
+            std::cerr << "[connection] Error while replying: " << ec_write.message() << std::endl;
+        response_written();
+    };
+    on_stream([&](auto &stream)
+        { async_write(stream, asio::buffer(_response_string, _response_string.length()), on_written); });
+}
+
+inline void connection::response_written()
+{
+#ifdef REQUEST_TRACING
+    finish_trace();
+#endif
+#ifdef OPEN_SSL
+    if (!_tls)
+#endif
+    {
+        // Every response closes the connection, don't make the client wait until the connection is deleted to see that.
+        asio::error_code ec;
+        _socket.lowest_layer().shutdown(asio::socket_base::shutdown_send, ec);
+    }
+    close_me = true;
+}
+
+inline void connection::close_if_idle()
+{
+    if (_in_flight || close_me)
+        return;
+
+    asio::error_code ec;
+    _socket.lowest_layer().cancel(ec);
+}
+
+inline void connection::write_preserialized_response(const std::string &response)
+{
+    auto on_written = [&](const std::error_code ec_write, const std::size_t)
+    {
+        if (ec_write)
+            std::cerr << "[connection] Error while rejecting: " << ec_write.message() << std::endl;
+        response_written();
+    };
+    on_stream([&](auto &stream) { async_write(stream, asio::buffer(response), on_written); });
+}
+
+inline void connection::start_stream(web_response &response)
+{
+    _response_string = response.stream_header_string();
+    auto on_written = [self = shared_from_this(), stream_function = std::move(response.stream_function),
+                          chunked = response.is_chunked()](const std::error_code ec_write, const std::size_t)
+    {
+        if (ec_write)
         {
-            if (ec_write || bytes_written != _response_string.length())
-                std::cerr << "[connection] Error while replying: " << ec_write.message() << std::endl;
-            close_me = true;
-        });
+            std::cerr << "[connection] Error while replying: " << ec_write.message() << std::endl;
+            self->close_me = true;
+            return;
+        }
+
+        // The stream only holds a weak reference, a handler that keeps it after the server stopped must not keep
+        // the socket alive.
+        auto write_function = [weak = std::weak_ptr<connection>(self)](std::shared_ptr<const std::string> bytes,
+                                  response_stream::write_callback on_written)
+        {
+            const auto self = weak.lock();
+            // Handlers may write from their own threads, the socket may only be used from the context thread.
+            if (!self || !self->post_to_stream(
+                             [self, bytes, on_written]()
+                             {
+                                 auto on_chunk_written = [self, bytes, on_written](
+                                                             const std::error_code ec, const std::size_t)
+                                 {
+                                     if (ec)
+                                         std::cerr << "[connection] Error while streaming: " << ec.message()
+                                                   << std::endl;
+                                     on_written(ec);
+                                 };
+                                 self->on_stream([&](auto &stream)
+                                     { async_write(stream, asio::buffer(*bytes), on_chunk_written); });
+                             }))
+                on_written(asio::error::operation_aborted);
+        };
+        // The stream can end on the handler's thread.
+        auto finished_function = [weak = std::weak_ptr<connection>(self)]()
+        {
+            if (const auto self = weak.lock())
+                self->post_to_stream([self]() { self->response_written(); }, true);
+        };
+
+        auto stream =
+            std::make_shared<response_stream>(std::move(write_function), std::move(finished_function), chunked);
+        {
+            std::lock_guard<std::mutex> guard(self->_stream_mutex);
+            self->_stream = stream;
+            self->_stream_open = true;
+        }
+        stream_function(stream);
+        if (self->_close_stream_when_open)
+            stream->close();
+    };
+    on_stream([&](auto &stream)
+        { async_write(stream, asio::buffer(_response_string, _response_string.length()), std::move(on_written)); });
+}
+
+inline bool connection::post_to_stream(std::function<void()> function, const bool last)
+{
+    std::lock_guard<std::mutex> guard(_stream_mutex);
+    if (!_stream_open)
+        return false;
+
+    asio::post(_socket.get_executor(), std::move(function));
+    if (last)
+        _stream_open = false;
+    return true;
+}
+
+inline void connection::close_stream()
+{
+    std::shared_ptr<response_stream> stream;
+    {
+        std::lock_guard<std::mutex> guard(_stream_mutex);
+        stream = _stream.lock();
+    }
+    // Closing writes the end through post_to_stream, which takes the lock again.
+    if (stream)
+        stream->close();
+    else if (_in_flight && !close_me)
+        _close_stream_when_open = true;
+}
+
+inline void connection::abort_stream()
+{
+    std::shared_ptr<response_stream> stream;
+    {
+        std::lock_guard<std::mutex> guard(_stream_mutex);
+        _stream_open = false;
+        stream = _stream.lock();
+    }
+    if (stream)
+        stream->abort();
 }
 
 #ifdef OPEN_SSL
@@ -211,11 +606,14 @@ inline void connection::do_handshake()
         {
             if (!error)
             {
+                TRACE_PHASE(_trace, HANDSHAKE);
                 read_header();
             }
             else
             {
-                std::cerr << "[connection] Error: " << error.message() << std::endl;
+                if (error != asio::error::operation_aborted)
+                    std::cerr << "[connection] Error: " << error.message() << std::endl;
+                close_me = true;
             }
         });
 }
@@ -231,3 +629,14 @@ inline void connection::ssl_shutdown(const asio::error_code &ec)
         std::cout << ec2.message() << std::endl;
 }
 #endif
+
+#ifdef REQUEST_TRACING
+inline void connection::finish_trace()
+{
+    TRACE_PHASE(_trace, WRITE);
+    if (trace_function)
+        trace_function(_trace);
+}
+#endif
+
+#undef TRACE_PHASE
@@ -0,0 +1,11 @@
+#pragma once
+
+/**
+ * \brief How important an endpoint is when the server is overloaded.
+ * NORMAL endpoints are rejected first, HIGH endpoints (health checks, payments...) are always served.
+ */
+enum class PRIORITIES
+{
+    NORMAL,
+    HIGH
+};
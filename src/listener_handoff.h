@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * \brief Passes a file descriptor to another process over a connected unix socket (SCM_RIGHTS).
+ * This is used to hand the listening sockets to a new process so that no connection is refused during an upgrade.
+ */
+namespace handoff
+{
+/**
+ * \brief Every descriptor is sent with a record of this size, holding the name it was sent with.
+ * It fits any unix socket path so the receiver knows which listener the descriptor belongs to.
+ */
+constexpr std::size_t record_size = 1 + sizeof(sockaddr_un::sun_path);
+
+/**
+ * \brief Sends fd over the unix socket. The receiver gets its own copy so the sender may close fd afterwards.
+ * \param unix_socket A connected AF_UNIX stream socket.
+ * \param fd The file descriptor to send.
+ * \param name Tells the receiver what fd is, at most record_size - 1 characters.
+ * \return true if the descriptor was sent.
+ */
+inline bool send_fd(const int unix_socket, const int fd, const std::string &name = "")
+{
+    if (name.length() >= record_size)
+    {
+        std::cerr << "[handoff] Error: the name " << name << " is too long" << std::endl;
+        return false;
+    }
+
+    char data[record_size]{'F'};
+    std::memcpy(data + 1, name.data(), name.length());
+    iovec io{data, sizeof(data)};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+    msghdr message{};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    auto *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    if (::sendmsg(unix_socket, &message, 0) < 0)
+    {
+        std::cerr << "[handoff] Error: sendmsg failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Receives a file descriptor sent with send_fd.
+ * \param unix_socket A connected AF_UNIX stream socket.
+ * \param name Set to the name the descriptor was sent with.
+ * \return The received file descriptor or -1, also when the sender closed the socket because it has nothing left.
+ */
+inline int receive_fd(const int unix_socket, std::string *name = nullptr)
+{
+    char data[record_size]{};
+    iovec io{data, sizeof(data)};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+    msghdr message{};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    const auto received = ::recvmsg(unix_socket, &message, MSG_WAITALL);
+    if (received == 0)
+        return -1;
+    if (received < 0)
+    {
+        std::cerr << "[handoff] Error: recvmsg failed: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    const auto *header = CMSG_FIRSTHDR(&message);
+    if (header == nullptr || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+    {
+        std::cerr << "[handoff] Error: no file descriptor was received" << std::endl;
+        return -1;
+    }
+
+    int fd;
+    std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+    if (static_cast<std::size_t>(received) != record_size)
+    {
+        std::cerr << "[handoff] Error: the descriptor was sent without its name" << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    if (name)
+        *name = std::string(data + 1, ::strnlen(data + 1, record_size - 1));
+    return fd;
+}
+} // namespace handoff
+
+#endif
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "enums/priority.h"
+
+/**
+ * \brief When requests should be shed.
+ */
+struct load_shedding_settings
+{
+    /**
+     * \brief The queueing delay the server aims for.
+     */
+    std::chrono::microseconds target = std::chrono::milliseconds(5);
+    /**
+     * \brief The server is overloaded when no probe in a whole interval waited less than target.
+     */
+    std::chrono::microseconds interval = std::chrono::milliseconds(100);
+    /**
+     * \brief How often the queueing delay of the context is measured, a few times per interval is enough.
+     */
+    std::chrono::microseconds probe_every = std::chrono::milliseconds(10);
+    /**
+     * \brief Sent to rejected clients in the Retry-After header.
+     */
+    unsigned retry_after_seconds = 1;
+};
+
+/**
+ * \brief A snapshot of the shedding decisions that were made.
+ */
+struct load_shedding_counters
+{
+    std::uint64_t admitted = 0;
+    std::uint64_t shed = 0;
+    /**
+     * \brief High priority requests that were served while the server was overloaded.
+     */
+    std::uint64_t high_priority_admitted_while_overloaded = 0;
+    /**
+     * \brief The amount of intervals the server spent overloaded.
+     */
+    std::uint64_t overloaded_intervals = 0;
+};
+
+/**
+ * \brief CoDel style admission control.
+ * It tracks the minimum time work waits in the queue of the context (the sojourn time) per interval. A short burst
+ * raises the average but not the minimum, so the server only counts as overloaded when a standing queue builds up.
+ * While it is overloaded NORMAL priority requests are rejected before their body is read or their handler is called.
+ *
+ * The sojourn time is measured with probes that run on the context, not with the requests themselves. A TLS
+ * handshake or a client that is slow to send its request isn't queueing, and intervals in which everything was shed are
+ * still measured. Shedding is cheap, so a standing queue drains quickly and the server goes back to admitting NORMAL
+ * requests in the next interval; under sustained overload it alternates between overloaded and not overloaded
+ * intervals, which shows in overloaded_intervals.
+ */
+class load_shedder
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    explicit load_shedder(const load_shedding_settings &settings = {});
+    load_shedder(const load_shedder &other) = delete;
+    load_shedder(const load_shedder &&other) = delete;
+    load_shedder &operator=(const load_shedder &other) = delete;
+    load_shedder &operator=(const load_shedder &&other) = delete;
+    ~load_shedder() = default;
+
+    /**
+     * \brief Replaces the settings. Call this before the server is started.
+     */
+    void configure(const load_shedding_settings &settings);
+    /**
+     * \brief Called when a probe is scheduled to run at due.
+     * A probe that still hasn't run when an interval ends counts as having waited since it was due, otherwise a queue
+     * that is longer than the interval would never be measured. Must be called from the context thread.
+     */
+    void probe_scheduled(clock::time_point due);
+    /**
+     * \brief Records how late a probe ran.
+     * Must be called from the context thread.
+     */
+    void record_sojourn(clock::duration sojourn, clock::time_point now = clock::now());
+    /**
+     * \brief Decides if a request can be served.
+     * Must be called from the context thread.
+     * \return false if the request should be rejected with rejection_response().
+     */
+    bool admit(PRIORITIES priority, clock::time_point now = clock::now());
+    bool overloaded() const;
+    load_shedding_counters counters() const;
+    /**
+     * \brief The preserialized 503 response for rejected requests.
+     */
+    const std::string &rejection_response() const;
+
+  private:
+    /**
+     * \brief Decides if the interval that just ended was overloaded and starts a new one.
+     */
+    void end_interval(clock::time_point now);
+
+    load_shedding_settings _settings;
+    std::string _rejection_response;
+    clock::time_point _interval_end;
+    clock::duration _interval_min = clock::duration::max();
+    /**
+     * \brief When the probe that hasn't run yet is due, or the epoch if there is none.
+     */
+    clock::time_point _probe_due;
+    std::atomic<bool> _overloaded{false};
+    std::atomic<std::uint64_t> _admitted{0};
+    std::atomic<std::uint64_t> _shed{0};
+    std::atomic<std::uint64_t> _high_priority_admitted_while_overloaded{0};
+    std::atomic<std::uint64_t> _overloaded_intervals{0};
+};
+
+inline load_shedder::load_shedder(const load_shedding_settings &settings)
+{
+    configure(settings);
+}
+
+inline void load_shedder::configure(const load_shedding_settings &settings)
+{
+    _settings = settings;
+    const std::string body = "Service Unavailable";
+    _rejection_response = "HTTP/1.1 503 Service Unavailable\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: " +
+                          std::to_string(body.length()) +
+                          "\r\n"
+                          "Retry-After: " +
+                          std::to_string(_settings.retry_after_seconds) +
+                          "\r\n"
+                          "Connection: close\r\n\r\n" +
+                          body;
+}
+
+inline void load_shedder::probe_scheduled(const clock::time_point due)
+{
+    _probe_due = due;
+}
+
+inline void load_shedder::record_sojourn(const clock::duration sojourn, const clock::time_point now)
+{
+    if (now >= _interval_end)
+        end_interval(now);
+
+    _interval_min = std::min(_interval_min, sojourn);
+    _probe_due = clock::time_point();
+}
+
+inline bool load_shedder::admit(const PRIORITIES priority, const clock::time_point now)
+{
+    // The decision must not be based on an interval that has already ended, even if its probe is late.
+    if (now >= _interval_end)
+        end_interval(now);
+
+    if (!_overloaded)
+    {
+        _admitted++;
+        return true;
+    }
+
+    if (priority == PRIORITIES::HIGH)
+    {
+        _admitted++;
+        _high_priority_admitted_while_overloaded++;
+        return true;
+    }
+
+    _shed++;
+    return false;
+}
+
+inline void load_shedder::end_interval(const clock::time_point now)
+{
+    if (_probe_due != clock::time_point() && now > _probe_due)
+        _interval_min = std::min(_interval_min, now - _probe_due);
+
+    // An interval without any probe says nothing about the queue, so it doesn't count as overloaded.
+    const auto overloaded = _interval_min != clock::duration::max() && _interval_min > _settings.target;
+    if (overloaded)
+        _overloaded_intervals++;
+    _overloaded = overloaded;
+    _interval_min = clock::duration::max();
+    _interval_end = now + _settings.interval;
+}
+
+inline bool load_shedder::overloaded() const
+{
+    return _overloaded;
+}
+
+inline load_shedding_counters load_shedder::counters() const
+{
+    return {_admitted, _shed, _high_priority_admitted_while_overloaded, _overloaded_intervals};
+}
+
+inline const std::string &load_shedder::rejection_response() const
+{
+    return _rejection_response;
+}
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "structs/multipart_part.h"
+
+/**
+ * \brief An incremental multipart/form-data parser.
+ * The body is fed in pieces as it arrives from the socket. Only the unparsed tail of the last piece is buffered, and
+ * once the parts kept in memory add up to the spill threshold the next ones are written to temporary files, so a large
+ * upload uses bounded memory no matter how it is split into parts.
+ */
+class multipart_parser
+{
+  public:
+    /**
+     * \brief Constructor
+     * \param boundary The boundary parameter of the Content-Type header.
+     * \param spill_threshold How many bytes of content all the parts together may keep in memory. A part that doesn't
+     * fit anymore is written to a temporary file.
+     * \param spill_directory Where the temporary files are created.
+     */
+    explicit multipart_parser(std::string_view boundary, std::size_t spill_threshold = 1024 * 1024,
+        std::filesystem::path spill_directory = std::filesystem::temp_directory_path());
+    multipart_parser(const multipart_parser &other) = delete;
+    multipart_parser(const multipart_parser &&other) = delete;
+    multipart_parser &operator=(const multipart_parser &other) = delete;
+    multipart_parser &operator=(const multipart_parser &&other) = delete;
+    ~multipart_parser() = default;
+
+    /**
+     * \brief Parses the next piece of the body.
+     * \param data Any amount of bytes, it doesn't have to line up with the parts.
+     * \return false if the body is malformed, has too many parts or a temporary file couldn't be written.
+     */
+    bool feed(std::string_view data);
+    /**
+     * \return true once the closing boundary has been read.
+     */
+    bool done() const;
+    /**
+     * \brief The parts that have been read completely.
+     */
+    std::vector<multipart_part> &parts();
+
+    /**
+     * \brief Gets the boundary out of a Content-Type header.
+     * \return The boundary or an empty string if the content type isn't multipart/form-data.
+     */
+    static std::string boundary_from_content_type(std::string_view content_type);
+
+  private:
+    enum class STATES
+    {
+        PREAMBLE,
+        AFTER_BOUNDARY,
+        HEADERS,
+        BODY,
+        DONE,
+        FAILED
+    };
+
+    /**
+     * \brief Stores the header block of the current part and splits it into names and values.
+     */
+    bool begin_part(std::string_view raw_headers);
+    /**
+     * \brief Adds content to the current part, moving it to a temporary file once it gets too big.
+     */
+    bool append_body(std::string_view data);
+    bool end_part();
+    /**
+     * \brief Moves the content of the current part that is in memory to a new temporary file.
+     */
+    bool spill_current_part();
+    /**
+     * \brief Creates a file with a unique name in the spill directory.
+     * It is created exclusively and readable by the owner only, so a file or symlink planted in a shared temp directory
+     * can't be opened instead.
+     * \param path Set to the path of the new file.
+     * \return The open file or nullptr.
+     */
+    std::FILE *create_temp_file(std::filesystem::path &path) const;
+
+    struct file_closer
+    {
+        void operator()(std::FILE *file) const
+        {
+            std::fclose(file);
+        }
+    };
+
+    /**
+     * \brief The maximum size of the header block of a single part.
+     */
+    static constexpr std::size_t max_header_length = 16 * 1024;
+    /**
+     * \brief The maximum amount of parts in a body, every part keeps its header block in memory.
+     */
+    static constexpr std::size_t max_parts = 1000;
+
+    std::string _delimiter;
+    /**
+     * \brief Boyer-Moore-Horspool over _delimiter, built once so every search is sublinear in the buffered data.
+     */
+    std::boyer_moore_horspool_searcher<std::string::const_iterator> _searcher;
+    std::size_t _spill_threshold;
+    std::filesystem::path _spill_directory;
+    STATES _state = STATES::PREAMBLE;
+    /**
+     * \brief The bytes that couldn't be parsed yet, at most one delimiter (or header block) long between feeds.
+     */
+    std::string _buffer;
+    multipart_part _current;
+    std::unique_ptr<std::FILE, file_closer> _current_file;
+    /**
+     * \brief The content of all the parts that is kept in memory, this stays below the spill threshold.
+     */
+    std::size_t _memory_used = 0;
+    std::vector<multipart_part> _parts;
+};
+
+inline multipart_parser::multipart_parser(
+    const std::string_view boundary, const std::size_t spill_threshold, std::filesystem::path spill_directory)
+    : _delimiter("\r\n--" + std::string(boundary)), _searcher(_delimiter.cbegin(), _delimiter.cend()),
+      _spill_threshold(spill_threshold), _spill_directory(std::move(spill_directory))
+{
+    // The first boundary doesn't have to be preceded by a line break, pretend it was.
+    _buffer = "\r\n";
+}
+
+inline bool multipart_parser::feed(const std::string_view data)
+{
+    if (_state == STATES::FAILED)
+        return false;
+    if (_state == STATES::DONE)
+        return true;
+
+    _buffer.append(data);
+    std::size_t position = 0;
+
+    while (true)
+    {
+        const std::string_view pending = std::string_view(_buffer).substr(position);
+
+        if (_state == STATES::PREAMBLE || _state == STATES::BODY)
+        {
+            const auto match = std::search(_buffer.cbegin() + position, _buffer.cend(), _searcher);
+            if (match == _buffer.cend())
+            {
+                // Keep enough to recognise a delimiter that is split over two feeds.
+                const auto keep = std::min(pending.length(), _delimiter.length() - 1);
+                if (_state == STATES::BODY && !append_body(pending.substr(0, pending.length() - keep)))
+                    break;
+                position += pending.length() - keep;
+                break;
+            }
+
+            const auto match_offset = static_cast<std::size_t>(match - (_buffer.cbegin() + position));
+            if (_state == STATES::BODY && (!append_body(pending.substr(0, match_offset)) || !end_part()))
+                break;
+            position += match_offset + _delimiter.length();
+            _state = STATES::AFTER_BOUNDARY;
+        }
+        else if (_state == STATES::AFTER_BOUNDARY)
+        {
+            if (pending.length() < 2)
+                break;
+            if (pending.substr(0, 2) == "--")
+            {
+                _state = STATES::DONE;
+                position = _buffer.length();
+                break;
+            }
+
+            // Transport padding is allowed after the boundary.
+            const auto line_end = pending.find("\r\n");
+            if (line_end == std::string_view::npos)
+            {
+                if (pending.length() > max_header_length)
+                    _state = STATES::FAILED;
+                break;
+            }
+            if (pending.substr(0, line_end).find_first_not_of(" \t") != std::string_view::npos)
+            {
+                _state = STATES::FAILED;
+                break;
+            }
+            position += line_end + 2;
+            _state = STATES::HEADERS;
+        }
+        else if (_state == STATES::HEADERS)
+        {
+            // A part without headers starts with an empty line straight away.
+            const auto headers_end = pending.substr(0, 2) == "\r\n" ? 0 : pending.find("\r\n\r\n");
+            if (headers_end == std::string_view::npos)
+            {
+                if (pending.length() > max_header_length)
+                    _state = STATES::FAILED;
+                break;
+            }
+            if (!begin_part(pending.substr(0, headers_end)))
+                break;
+            position += headers_end + (headers_end == 0 ? 2 : 4);
+            _state = STATES::BODY;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    _buffer.erase(0, position);
+    if (_state == STATES::DONE)
+        _buffer.clear();
+    return _state != STATES::FAILED;
+}
+
+inline bool multipart_parser::done() const
+{
+    return _state == STATES::DONE;
+}
+
+inline std::vector<multipart_part> &multipart_parser::parts()
+{
+    return _parts;
+}
+
+inline std::string multipart_parser::boundary_from_content_type(const std::string_view content_type)
+{
+    const auto trim = [](std::string_view value)
+    {
+        const auto start = value.find_first_not_of(" \t");
+        if (start == std::string_view::npos)
+            return std::string_view();
+        value.remove_prefix(start);
+        return value.substr(0, value.find_last_not_of(" \t") + 1);
+    };
+    const auto equal_ignoring_case = [](const std::string_view a, const std::string_view b)
+    {
+        return a.length() == b.length() &&
+               std::equal(a.begin(), a.end(), b.begin(),
+                   [](const char x, const char y)
+                   {
+                       return std::tolower(static_cast<unsigned char>(x)) ==
+                              std::tolower(static_cast<unsigned char>(y));
+                   });
+    };
+
+    // Media types and parameter names are case-insensitive, the boundary itself isn't.
+    auto parameter_start = content_type.find(';');
+    if (!equal_ignoring_case(trim(content_type.substr(0, parameter_start)), "multipart/form-data"))
+        return "";
+
+    while (parameter_start != std::string_view::npos)
+    {
+        const auto parameter_end = content_type.find(';', parameter_start + 1);
+        // npos - parameter_start is still past the end, so the last parameter runs to the end.
+        const auto parameter = content_type.substr(parameter_start + 1, parameter_end - parameter_start - 1);
+        parameter_start = parameter_end;
+
+        const auto equals = parameter.find('=');
+        if (equals == std::string_view::npos || !equal_ignoring_case(trim(parameter.substr(0, equals)), "boundary"))
+            continue;
+
+        auto boundary = trim(parameter.substr(equals + 1));
+        if (!boundary.empty() && boundary.front() == '"')
+        {
+            boundary.remove_prefix(1);
+            return std::string(boundary.substr(0, boundary.find('"')));
+        }
+        return std::string(boundary);
+    }
+
+    return "";
+}
+
+inline bool multipart_parser::begin_part(const std::string_view raw_headers)
+{
+    if (_parts.size() >= max_parts)
+    {
+        _state = STATES::FAILED;
+        return false;
+    }
+
+    _current = multipart_part{};
+    _current.raw_headers = std::string(raw_headers);
+
+    std::size_t line_start = 0;
+    while (line_start < raw_headers.length())
+    {
+        auto line_end = raw_headers.find("\r\n", line_start);
+        if (line_end == std::string_view::npos)
+            line_end = raw_headers.length();
+
+        const auto colon = raw_headers.find(':', line_start);
+        if (colon == std::string_view::npos || colon > line_end)
+        {
+            _state = STATES::FAILED;
+            return false;
+        }
+        auto value_start = raw_headers.find_first_not_of(' ', colon + 1);
+        if (value_start == std::string_view::npos || value_start > line_end)
+            value_start = line_end;
+
+        _current.header_offsets.push_back(
+            {{line_start, colon - line_start}, {value_start, line_end - value_start}});
+        line_start = line_end + 2;
+    }
+
+    return true;
+}
+
+inline bool multipart_parser::append_body(const std::string_view data)
+{
+    if (data.empty())
+        return true;
+
+    _current.size += data.length();
+    if (!_current.file)
+    {
+        // The threshold covers all the parts together, otherwise many parts just below it would still add up.
+        if (_memory_used + data.length() <= _spill_threshold)
+        {
+            _current.body.append(data);
+            _memory_used += data.length();
+            return true;
+        }
+        if (!spill_current_part())
+            return false;
+    }
+
+    if (std::fwrite(data.data(), 1, data.length(), _current_file.get()) != data.length())
+    {
+        std::cerr << "[multipart_parser] Error: couldn't write to " << _current.file->path() << std::endl;
+        _state = STATES::FAILED;
+        return false;
+    }
+    return true;
+}
+
+inline bool multipart_parser::spill_current_part()
+{
+    std::filesystem::path path;
+    _current_file.reset(create_temp_file(path));
+    if (!_current_file)
+    {
+        std::cerr << "[multipart_parser] Error: couldn't create a temporary file in " << _spill_directory << std::endl;
+        _state = STATES::FAILED;
+        return false;
+    }
+
+    _current.file = std::make_shared<temp_file>(path);
+    if (std::fwrite(_current.body.data(), 1, _current.body.length(), _current_file.get()) != _current.body.length())
+    {
+        std::cerr << "[multipart_parser] Error: couldn't write to " << path << std::endl;
+        _state = STATES::FAILED;
+        return false;
+    }
+
+    _memory_used -= _current.body.length();
+    _current.body = std::string();
+    return true;
+}
+
+inline std::FILE *multipart_parser::create_temp_file(std::filesystem::path &path) const
+{
+#ifndef _WIN32
+    // mkstemp creates the file with O_CREAT | O_EXCL and mode 0600.
+    auto name = (_spill_directory / "web_server_upload_XXXXXX").string();
+    const auto fd = ::mkstemp(name.data());
+    if (fd < 0)
+        return nullptr;
+
+    auto *file = ::fdopen(fd, "wb");
+    if (file == nullptr)
+    {
+        ::close(fd);
+        ::unlink(name.c_str());
+        return nullptr;
+    }
+    path = name;
+    return file;
+#else
+    static std::atomic<unsigned> file_counter{0};
+    path = _spill_directory / ("web_server_upload_" +
+                                  std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "_" +
+                                  std::to_string(file_counter++));
+    // "x" fails if the file already exists instead of opening it.
+    return std::fopen(path.string().c_str(), "wbx");
+#endif
+}
+
+inline bool multipart_parser::end_part()
+{
+    if (_current_file && std::fclose(_current_file.release()) != 0)
+    {
+        std::cerr << "[multipart_parser] Error: couldn't write to " << _current.file->path() << std::endl;
+        _state = STATES::FAILED;
+        return false;
+    }
+
+    _parts.push_back(std::move(_current));
+    _current = multipart_part{};
+    return true;
+}
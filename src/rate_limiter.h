@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * \brief The settings of a single token bucket.
+ * A bucket holds at most burst tokens and refills at requests_per_second.
+ * A rate_limit with requests_per_second <= 0 is disabled.
+ */
+struct rate_limit
+{
+    double requests_per_second = 0;
+    double burst = 0;
+};
+
+/**
+ * \brief A preserialized reply that is written to rate limited clients.
+ * It is sent as is so that no handler is called and nothing is allocated for a rejected request.
+ */
+inline const std::string too_many_requests_response = "HTTP/1.1 429 Too Many Requests\r\n"
+                                                      "Content-Type: text/plain\r\n"
+                                                      "Content-Length: 17\r\n"
+                                                      "Retry-After: 1\r\n"
+                                                      "Connection: close\r\n\r\n"
+                                                      "Too Many Requests";
+
+/**
+ * \brief Keeps a token bucket per key (client ip, route, api key...).
+ * The buckets are spread over shards with their own mutex so that concurrent checks rarely contend.
+ * Buckets are only refilled when they are touched and idle buckets are swept lazily.
+ */
+class rate_limiter
+{
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * \brief Constructor
+     * \param shard_count The amount of independently locked hash tables.
+     */
+    explicit rate_limiter(std::size_t shard_count = 16);
+    rate_limiter(const rate_limiter &other) = delete;
+    rate_limiter(const rate_limiter &&other) = delete;
+    rate_limiter &operator=(const rate_limiter &other) = delete;
+    rate_limiter &operator=(const rate_limiter &&other) = delete;
+    ~rate_limiter() = default;
+
+    /**
+     * \brief Takes a token from the bucket of key.
+     * \param key The client ip, route or api key the bucket belongs to.
+     * \param limit The settings of the bucket.
+     * \param now The time of the request.
+     * \return false if the bucket is empty and the request should be rejected.
+     */
+    bool try_acquire(const std::string &key, const rate_limit &limit, clock::time_point now = clock::now());
+    /**
+     * \brief Checks if the bucket of key has a token left without taking it.
+     * \return false if try_acquire would reject the request.
+     */
+    bool can_acquire(const std::string &key, const rate_limit &limit, clock::time_point now = clock::now());
+
+  private:
+    struct token_bucket
+    {
+        double tokens;
+        clock::time_point last_refill;
+        /**
+         * \brief When the bucket will be full again. After that it is the same as a new bucket and can be deleted.
+         */
+        clock::time_point full_at;
+    };
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, token_bucket> buckets;
+        clock::time_point next_sweep;
+    };
+
+    /**
+     * \brief Deletes all the buckets that have refilled completely.
+     * The shard's mutex must be held.
+     */
+    static void sweep(shard &s, clock::time_point now);
+
+    std::size_t _shard_count;
+    std::unique_ptr<shard[]> _shards;
+};
+
+inline rate_limiter::rate_limiter(const std::size_t shard_count)
+    : _shard_count(shard_count == 0 ? 1 : shard_count), _shards(std::make_unique<shard[]>(_shard_count))
+{
+}
+
+inline bool rate_limiter::try_acquire(const std::string &key, const rate_limit &limit, const clock::time_point now)
+{
+    if (limit.requests_per_second <= 0)
+        return true;
+
+    const auto burst = limit.burst < 1 ? 1.0 : limit.burst;
+    auto &s = _shards[std::hash<std::string>{}(key) % _shard_count];
+    std::lock_guard<std::mutex> guard(s.mutex);
+
+    if (now >= s.next_sweep)
+    {
+        sweep(s, now);
+        s.next_sweep = now + std::chrono::seconds(1);
+    }
+
+    auto [it, inserted] = s.buckets.try_emplace(key, token_bucket{burst, now, now});
+    auto &bucket = it->second;
+    if (!inserted)
+    {
+        const std::chrono::duration<double> elapsed = now - bucket.last_refill;
+        bucket.tokens = std::min(burst, bucket.tokens + elapsed.count() * limit.requests_per_second);
+        bucket.last_refill = now;
+    }
+
+    if (bucket.tokens < 1)
+        return false;
+
+    bucket.tokens -= 1;
+    bucket.full_at = now + std::chrono::duration_cast<clock::duration>(
+                               std::chrono::duration<double>((burst - bucket.tokens) / limit.requests_per_second));
+    return true;
+}
+
+inline bool rate_limiter::can_acquire(const std::string &key, const rate_limit &limit, const clock::time_point now)
+{
+    if (limit.requests_per_second <= 0)
+        return true;
+
+    auto &s = _shards[std::hash<std::string>{}(key) % _shard_count];
+    std::lock_guard<std::mutex> guard(s.mutex);
+
+    // A key without a bucket starts with a full one.
+    const auto it = s.buckets.find(key);
+    if (it == s.buckets.end())
+        return true;
+
+    const std::chrono::duration<double> elapsed = now - it->second.last_refill;
+    return it->second.tokens + elapsed.count() * limit.requests_per_second >= 1;
+}
+
+inline void rate_limiter::sweep(shard &s, const clock::time_point now)
+{
+    for (auto it = s.buckets.begin(); it != s.buckets.end();)
+    {
+        if (it->second.full_at <= now)
+            it = s.buckets.erase(it);
+        else
+            ++it;
+    }
+}
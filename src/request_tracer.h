@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "enums/method.h"
+
+/**
+ * \brief The points in the life of a request where a timestamp is taken.
+ * Each phase ends at its timestamp and starts at the previous timestamp that was taken.
+ */
+enum class TRACE_PHASES
+{
+    ACCEPTED,
+    HANDSHAKE,
+    READ_HEADER,
+    READ_BODY,
+    HANDLER,
+    WRITE,
+    COUNT
+};
+
+namespace trace_phases
+{
+inline std::string phase_to_string(const TRACE_PHASES &phase)
+{
+    switch (phase)
+    {
+    case TRACE_PHASES::ACCEPTED:
+        return "accept";
+    case TRACE_PHASES::HANDSHAKE:
+        return "tls_handshake";
+    case TRACE_PHASES::READ_HEADER:
+        return "read_header";
+    case TRACE_PHASES::READ_BODY:
+        return "read_body";
+    case TRACE_PHASES::HANDLER:
+        return "handler";
+    case TRACE_PHASES::WRITE:
+        return "async_write";
+    case TRACE_PHASES::COUNT:
+        break;
+    }
+
+    return "UNKNOWN";
+}
+} // namespace trace_phases
+
+/**
+ * \brief The timestamps of a single request.
+ * A phase that was never reached (no handshake without SSL, no handler for a rejected request) keeps a zero timestamp.
+ */
+struct request_trace
+{
+    using clock = std::chrono::steady_clock;
+
+    std::array<clock::time_point, static_cast<std::size_t>(TRACE_PHASES::COUNT)> timestamps{};
+    METHODS method = METHODS::GET;
+    std::string url;
+
+    inline void mark(const TRACE_PHASES phase)
+    {
+        timestamps[static_cast<std::size_t>(phase)] = clock::now();
+    }
+
+    inline clock::duration total() const
+    {
+        const auto &start = timestamps[static_cast<std::size_t>(TRACE_PHASES::ACCEPTED)];
+        for (auto it = timestamps.rbegin(); it != timestamps.rend(); ++it)
+        {
+            if (it->time_since_epoch().count() != 0)
+                return *it - start;
+        }
+        return clock::duration::zero();
+    }
+};
+
+/**
+ * \brief How the request_tracer decides what to keep.
+ */
+struct trace_settings
+{
+    /**
+     * \brief Keep 1 in sample_every requests. 0 only keeps slow requests.
+     */
+    unsigned sample_every = 100;
+    /**
+     * \brief Requests slower than this are always kept.
+     */
+    std::chrono::microseconds slow_threshold = std::chrono::milliseconds(100);
+    /**
+     * \brief The amount of sampled and of slow requests kept in memory between exports.
+     */
+    std::size_t capacity = 1024;
+    /**
+     * \brief Every export appends one OTLP-JSON line to this file.
+     */
+    std::string output_file = "web_server_traces.jsonl";
+};
+
+/**
+ * \brief Keeps a sample of the finished requests, and all the slow ones, in ring buffers and exports them as
+ * OpenTelemetry (OTLP-JSON) spans.
+ */
+class request_tracer
+{
+  public:
+    explicit request_tracer(trace_settings settings = {});
+    request_tracer(const request_tracer &other) = delete;
+    request_tracer(const request_tracer &&other) = delete;
+    request_tracer &operator=(const request_tracer &other) = delete;
+    request_tracer &operator=(const request_tracer &&other) = delete;
+    ~request_tracer() = default;
+
+    /**
+     * \brief Replaces the settings. Call this before the server is started.
+     */
+    void configure(const trace_settings &settings);
+    /**
+     * \brief Called when a request has finished. Keeps it if it was sampled or slow.
+     */
+    void record(const request_trace &trace);
+    /**
+     * \brief Appends the kept requests to the output file and forgets them.
+     * \return false if the file couldn't be written.
+     */
+    bool export_otlp_json();
+
+  private:
+    /**
+     * \brief A fixed size buffer where the newest trace overwrites the oldest.
+     */
+    struct ring
+    {
+        std::vector<request_trace> traces;
+        std::size_t next = 0;
+
+        void push(const request_trace &trace, std::size_t capacity);
+    };
+
+    std::uint64_t to_unix_nano(request_trace::clock::time_point time_point) const;
+    void append_spans(std::string &json, const request_trace &trace, bool slow);
+    std::string random_id(std::size_t bytes);
+
+    trace_settings _settings;
+    std::atomic<std::uint64_t> _request_count{0};
+    std::mutex _mutex;
+    ring _sampled;
+    ring _slow;
+    /**
+     * \brief steady_clock is used for the timestamps but OTLP wants unix time, this converts between the two.
+     */
+    std::chrono::nanoseconds _steady_to_unix;
+    std::mt19937_64 _random;
+};
+
+inline request_tracer::request_tracer(trace_settings settings)
+    : _settings(std::move(settings)),
+      _steady_to_unix(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch() - request_trace::clock::now().time_since_epoch())),
+      _random(std::random_device{}())
+{
+}
+
+inline void request_tracer::configure(const trace_settings &settings)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    _settings = settings;
+}
+
+inline void request_tracer::record(const request_trace &trace)
+{
+    const auto slow = trace.total() >= _settings.slow_threshold;
+    const auto sampled = _settings.sample_every != 0 && _request_count++ % _settings.sample_every == 0;
+    if (!slow && !sampled)
+        return;
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (slow)
+        _slow.push(trace, _settings.capacity);
+    else
+        _sampled.push(trace, _settings.capacity);
+}
+
+inline bool request_tracer::export_otlp_json()
+{
+    std::string json;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_sampled.traces.empty() && _slow.traces.empty())
+            return true;
+
+        json = R"({"resourceSpans":[{"resource":{"attributes":[{"key":"service.name","value":{"stringValue":)"
+               R"("web_server"}}]},"scopeSpans":[{"scope":{"name":"web_server"},"spans":[)";
+        for (const auto &trace : _slow.traces)
+            append_spans(json, trace, true);
+        for (const auto &trace : _sampled.traces)
+            append_spans(json, trace, false);
+        json.pop_back(); // the last comma
+        json += "]}]}]}\n";
+
+        _sampled = ring{};
+        _slow = ring{};
+    }
+
+    std::ofstream file(_settings.output_file, std::ios::app);
+    file << json;
+    if (!file)
+    {
+        std::cerr << "[request_tracer] Error: couldn't write to " << _settings.output_file << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline void request_tracer::ring::push(const request_trace &trace, const std::size_t capacity)
+{
+    if (capacity == 0)
+        return;
+
+    if (traces.size() < capacity)
+    {
+        traces.push_back(trace);
+        return;
+    }
+
+    traces[next] = trace;
+    next = (next + 1) % capacity;
+}
+
+inline std::uint64_t request_tracer::to_unix_nano(const request_trace::clock::time_point time_point) const
+{
+    return static_cast<std::uint64_t>(
+        (std::chrono::duration_cast<std::chrono::nanoseconds>(time_point.time_since_epoch()) + _steady_to_unix)
+            .count());
+}
+
+inline void request_tracer::append_spans(std::string &json, const request_trace &trace, const bool slow)
+{
+    const auto trace_id = random_id(16);
+    const auto root_span_id = random_id(8);
+    const auto start = trace.timestamps[static_cast<std::size_t>(TRACE_PHASES::ACCEPTED)];
+    const auto end = start + trace.total();
+
+    std::string url;
+    for (const auto c : trace.url)
+    {
+        if (c == '"' || c == '\\')
+            url.push_back('\\');
+        if (static_cast<unsigned char>(c) >= 0x20)
+            url.push_back(c);
+    }
+
+    const auto method = methods::method_to_string(trace.method);
+    json += R"({"traceId":")" + trace_id + R"(","spanId":")" + root_span_id + R"(","name":")" + method + " " + url +
+            R"(","kind":2,"startTimeUnixNano":")" + std::to_string(to_unix_nano(start)) +
+            R"(","endTimeUnixNano":")" + std::to_string(to_unix_nano(end)) +
+            R"(","attributes":[{"key":"http.method","value":{"stringValue":")" + method +
+            R"("}},{"key":"http.target","value":{"stringValue":")" + url +
+            R"("}},{"key":"web_server.slow","value":{"boolValue":)" + (slow ? "true" : "false") + "}}]},";
+
+    auto phase_start = start;
+    for (auto phase = static_cast<std::size_t>(TRACE_PHASES::HANDSHAKE); phase < trace.timestamps.size(); phase++)
+    {
+        const auto phase_end = trace.timestamps[phase];
+        if (phase_end.time_since_epoch().count() == 0)
+            continue;
+
+        json += R"({"traceId":")" + trace_id + R"(","spanId":")" + random_id(8) + R"(","parentSpanId":")" +
+                root_span_id + R"(","name":")" + trace_phases::phase_to_string(static_cast<TRACE_PHASES>(phase)) +
+                R"(","kind":1,"startTimeUnixNano":")" + std::to_string(to_unix_nano(phase_start)) +
+                R"(","endTimeUnixNano":")" + std::to_string(to_unix_nano(phase_end)) + R"("},)";
+        phase_start = phase_end;
+    }
+}
+
+inline std::string request_tracer::random_id(const std::size_t bytes)
+{
+    std::string id;
+    id.reserve(bytes * 2);
+    char hex[17];
+    for (std::size_t i = 0; i < bytes; i += 8)
+    {
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(_random()));
+        id.append(hex, std::min<std::size_t>(16, (bytes - i) * 2));
+    }
+    return id;
+}
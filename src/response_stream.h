@@ -0,0 +1,282 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "structs/response.h"
+
+/**
+ * \brief A response body that is sent in pieces while the handler is still producing it.
+ * Only one write can be in flight at a time. A write is rejected until the previous one has been written to the
+ * socket, which stops a fast producer from buffering a whole export in memory.
+ * All the functions can be called from any thread.
+ */
+class response_stream : public std::enable_shared_from_this<response_stream>
+{
+  public:
+    using write_callback = std::function<void(const std::error_code &)>;
+    using write_function_type = std::function<void(std::shared_ptr<const std::string>, write_callback)>;
+
+    /**
+     * \brief This is created by the connection once the response header has been written.
+     * \param write_function Writes the bytes to the socket and calls the callback once they have been written.
+     * \param finished_function Called once after the last bytes were written or the write failed.
+     * \param chunked If false the body is written as is and the end is signalled by closing the connection (HTTP/1.0).
+     */
+    response_stream(write_function_type write_function, std::function<void()> finished_function, bool chunked = true);
+    response_stream(const response_stream &other) = delete;
+    response_stream(const response_stream &&other) = delete;
+    response_stream &operator=(const response_stream &other) = delete;
+    response_stream &operator=(const response_stream &&other) = delete;
+    /**
+     * \brief Ends the response if the handler didn't call close().
+     */
+    ~response_stream();
+
+    /**
+     * \brief Sends data as one chunk.
+     * \param data The bytes to send. Empty data is ignored because an empty chunk ends the response.
+     * \param on_written Called once the chunk was written, this is where the next chunk should be written from.
+     * \return false if the previous write hasn't completed yet or the stream was closed.
+     */
+    bool write(std::string_view data, write_callback on_written = nullptr);
+    /**
+     * \brief Ends the response. If a write is still in flight the end is sent once it has completed.
+     */
+    void close();
+    /**
+     * \brief Closes the stream without ending the response, used when the server stops.
+     * Later writes return false and nothing is sent to the client any more.
+     */
+    void abort();
+    /**
+     * \return true if a call to write() would be accepted right now.
+     */
+    bool writable() const;
+    /**
+     * \return true once close() or abort() was called or a write failed.
+     */
+    bool closed() const;
+
+  private:
+    /**
+     * \brief Writes the terminating chunk. The caller must own _write_pending.
+     */
+    void write_end();
+
+    write_function_type _write_function;
+    std::function<void()> _finished_function;
+    bool _chunked;
+    std::atomic<bool> _write_pending{false};
+    std::atomic<bool> _closed{false};
+};
+
+/**
+ * \brief A thin wrapper over a response_stream that formats Server-Sent Events.
+ * It only holds a pointer to the stream so an idle subscriber costs little more than its socket.
+ */
+class sse_stream
+{
+  public:
+    explicit sse_stream(std::shared_ptr<response_stream> stream);
+
+    /**
+     * \brief Sends an event. Multi line data is split into multiple data fields.
+     * \param data The payload of the event.
+     * \param event The optional event type.
+     * \param id The optional event id that the client sends back as Last-Event-ID when it reconnects.
+     * \param on_written Called once the event was written.
+     * \return false if the previous event hasn't been written yet or the stream was closed.
+     */
+    bool send_event(std::string_view data, std::string_view event = "", std::string_view id = "",
+        response_stream::write_callback on_written = nullptr);
+    /**
+     * \brief Sends a comment, which clients ignore. Useful as a heartbeat to keep proxies from timing out.
+     */
+    bool send_comment(std::string_view comment, response_stream::write_callback on_written = nullptr);
+    void close();
+    bool writable() const;
+    bool closed() const;
+
+  private:
+    std::shared_ptr<response_stream> _stream;
+};
+
+/**
+ * \brief Turns the response into an event stream.
+ * \param response The response passed to the handler.
+ * \param on_open Called once the headers were sent, the sse_stream can be kept for as long as needed.
+ */
+inline void make_sse_response(web_response &response, std::function<void(sse_stream)> on_open)
+{
+    response.status_code = 200;
+    response.status = "OK";
+    response.content_type = "text/event-stream";
+    response.header_values["Cache-Control"] = "no-cache";
+    response.stream_function = [on_open = std::move(on_open)](std::shared_ptr<response_stream> stream)
+    { on_open(sse_stream(std::move(stream))); };
+}
+
+inline response_stream::response_stream(
+    write_function_type write_function, std::function<void()> finished_function, const bool chunked)
+    : _write_function(std::move(write_function)), _finished_function(std::move(finished_function)), _chunked(chunked)
+{
+}
+
+inline response_stream::~response_stream()
+{
+    // Nothing can be in flight here because every write keeps the stream alive until it completes.
+    if (!_write_pending.exchange(true))
+    {
+        auto finished_function = std::move(_finished_function);
+        if (_chunked)
+            _write_function(std::make_shared<const std::string>("0\r\n\r\n"),
+                [finished_function](const std::error_code &) { finished_function(); });
+        else
+            finished_function();
+    }
+}
+
+inline bool response_stream::write(const std::string_view data, write_callback on_written)
+{
+    if (data.empty())
+        return !_closed && !_write_pending;
+    if (_closed || _write_pending.exchange(true))
+        return false;
+
+    std::shared_ptr<const std::string> bytes;
+    if (_chunked)
+    {
+        char size[20];
+        const auto size_length = std::snprintf(size, sizeof(size), "%zx\r\n", data.length());
+        auto chunk = std::string(size, size_length);
+        chunk.reserve(chunk.length() + data.length() + 2);
+        chunk.append(data);
+        chunk.append("\r\n");
+        bytes = std::make_shared<const std::string>(std::move(chunk));
+    }
+    else
+    {
+        bytes = std::make_shared<const std::string>(data);
+    }
+
+    _write_function(std::move(bytes),
+        [self = shared_from_this(), on_written = std::move(on_written)](const std::error_code &ec)
+        {
+            if (ec)
+            {
+                // The client is gone, nothing else will be written.
+                self->_closed = true;
+                if (on_written)
+                    on_written(ec);
+                self->_finished_function();
+                return;
+            }
+
+            self->_write_pending = false;
+            if (on_written)
+                on_written(ec);
+            if (self->_closed && !self->_write_pending.exchange(true))
+                self->write_end();
+        });
+    return true;
+}
+
+inline void response_stream::close()
+{
+    _closed = true;
+    if (!_write_pending.exchange(true))
+        write_end();
+}
+
+inline void response_stream::abort()
+{
+    _closed = true;
+}
+
+inline bool response_stream::writable() const
+{
+    return !_closed && !_write_pending;
+}
+
+inline bool response_stream::closed() const
+{
+    return _closed;
+}
+
+inline void response_stream::write_end()
+{
+    if (!_chunked)
+    {
+        _finished_function();
+        return;
+    }
+
+    _write_function(std::make_shared<const std::string>("0\r\n\r\n"),
+        [self = shared_from_this()](const std::error_code &) { self->_finished_function(); });
+}
+
+inline sse_stream::sse_stream(std::shared_ptr<response_stream> stream) : _stream(std::move(stream))
+{
+}
+
+inline bool sse_stream::send_event(const std::string_view data, const std::string_view event,
+    const std::string_view id, response_stream::write_callback on_written)
+{
+    std::string message;
+    if (!event.empty())
+    {
+        message.append("event: ");
+        message.append(event);
+        message.push_back('\n');
+    }
+    if (!id.empty())
+    {
+        message.append("id: ");
+        message.append(id);
+        message.push_back('\n');
+    }
+
+    std::size_t line_start = 0;
+    while (true)
+    {
+        const auto line_end = data.find('\n', line_start);
+        message.append("data: ");
+        message.append(data.substr(line_start, line_end - line_start));
+        message.push_back('\n');
+        if (line_end == std::string_view::npos)
+            break;
+        line_start = line_end + 1;
+    }
+    message.push_back('\n');
+
+    return _stream->write(message, std::move(on_written));
+}
+
+inline bool sse_stream::send_comment(const std::string_view comment, response_stream::write_callback on_written)
+{
+    std::string message = ": ";
+    message.append(comment);
+    message.append("\n\n");
+    return _stream->write(message, std::move(on_written));
+}
+
+inline void sse_stream::close()
+{
+    _stream->close();
+}
+
+inline bool sse_stream::writable() const
+{
+    return _stream->writable();
+}
+
+inline bool sse_stream::closed() const
+{
+    return _stream->closed();
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief A file that is deleted once the last part referring to it is gone.
+ */
+class temp_file
+{
+  public:
+    explicit temp_file(std::filesystem::path path) : _path(std::move(path))
+    {
+    }
+    temp_file(const temp_file &other) = delete;
+    temp_file(const temp_file &&other) = delete;
+    temp_file &operator=(const temp_file &other) = delete;
+    temp_file &operator=(const temp_file &&other) = delete;
+    ~temp_file()
+    {
+        std::error_code ec;
+        std::filesystem::remove(_path, ec);
+    }
+
+    const std::filesystem::path &path() const
+    {
+        return _path;
+    }
+
+  private:
+    std::filesystem::path _path;
+};
+
+/**
+ * \brief One part of a multipart/form-data body.
+ * The content is kept in body while all the parts together fit in the spill threshold of the parser, after that it is
+ * written to file instead.
+ */
+struct multipart_part
+{
+    /**
+     * \brief The header block of the part as it was sent, header() returns views into it.
+     */
+    std::string raw_headers;
+    /**
+     * \brief Offsets of the (name, value) pairs in raw_headers. Offsets stay valid when the part is copied.
+     */
+    std::vector<std::pair<std::pair<std::size_t, std::size_t>, std::pair<std::size_t, std::size_t>>> header_offsets;
+    /**
+     * \brief The content of the part if it was small enough to keep in memory.
+     */
+    std::string body;
+    /**
+     * \brief The content of the part if it was spilled to disk, otherwise nullptr.
+     */
+    std::shared_ptr<temp_file> file;
+    /**
+     * \brief The size of the content, whether it is in body or in file.
+     */
+    std::size_t size = 0;
+
+    /**
+     * \brief Looks up a header of the part, ignoring case.
+     * \return A view into raw_headers or an empty view if the header wasn't sent.
+     */
+    inline std::string_view header(const std::string_view name) const
+    {
+        const std::string_view headers = raw_headers;
+        for (const auto &[key, value] : header_offsets)
+        {
+            const auto header_name = headers.substr(key.first, key.second);
+            if (header_name.length() == name.length() &&
+                std::equal(header_name.begin(), header_name.end(), name.begin(),
+                    [](const char a, const char b)
+                    {
+                        return std::tolower(static_cast<unsigned char>(a)) ==
+                               std::tolower(static_cast<unsigned char>(b));
+                    }))
+                return headers.substr(value.first, value.second);
+        }
+        return {};
+    }
+
+    /**
+     * \brief The name of the form field, from Content-Disposition.
+     */
+    inline std::string_view name() const
+    {
+        return disposition_parameter("name");
+    }
+
+    /**
+     * \brief The name of the uploaded file, from Content-Disposition. Empty for normal fields.
+     */
+    inline std::string_view filename() const
+    {
+        return disposition_parameter("filename");
+    }
+
+    inline std::string_view content_type() const
+    {
+        return header("Content-Type");
+    }
+
+  private:
+    inline std::string_view disposition_parameter(const std::string_view parameter) const
+    {
+        const auto disposition = header("Content-Disposition");
+        std::size_t position = 0;
+        while ((position = disposition.find(';', position)) != std::string_view::npos)
+        {
+            position = disposition.find_first_not_of(' ', position + 1);
+            if (position == std::string_view::npos)
+                break;
+            if (disposition.substr(position, parameter.length()) != parameter ||
+                disposition.substr(position + parameter.length(), 1) != "=")
+                continue;
+
+            auto value = disposition.substr(position + parameter.length() + 1);
+            if (!value.empty() && value.front() == '"')
+            {
+                value.remove_prefix(1);
+                return value.substr(0, value.find('"'));
+            }
+            return value.substr(0, value.find(';'));
+        }
+        return {};
+    }
+};
@@ -2,9 +2,23 @@
 
 #include <iostream>
 #include <map>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include "../enums/method.h"
+#include "multipart_part.h"
+
+/**
+ * \brief Who is on the other side of a unix domain socket (SO_PEERCRED).
+ * pid is -1 on systems that only report the user and group.
+ */
+struct peer_credentials
+{
+    int pid = -1;
+    unsigned uid = 0;
+    unsigned gid = 0;
+};
 
 /**
  * \brief This struct will contain everything that was sent in the request.
@@ -16,8 +30,20 @@ struct web_request
     std::string protocol;
     std::string version;
     std::map<std::string, std::string> header_values;
+    /**
+     * \brief The ip-address of the client that sent the request.
+     */
+    std::string remote_address;
+    /**
+     * \brief Only set for requests that came in over a unix domain socket.
+     */
+    std::optional<peer_credentials> peer;
 
     std::string body;
+    /**
+     * \brief The parts of a multipart/form-data body. The body itself stays empty for these requests.
+     */
+    std::vector<multipart_part> parts;
 
     friend std::ostream &operator<<(std::ostream &os, web_request &request_header)
     {
@@ -25,7 +51,13 @@ struct web_request
            << "URL: " << request_header.url << std::endl
            << "PROTOCOL: " << request_header.protocol << std::endl
            << "VERSION: " << request_header.version << std::endl
-           << "Extra headers: " << std::endl;
+           << "REMOTE ADDRESS: " << request_header.remote_address << std::endl;
+        if (request_header.peer)
+        {
+            os << "PEER: pid " << request_header.peer->pid << ", uid " << request_header.peer->uid << ", gid "
+               << request_header.peer->gid << std::endl;
+        }
+        os << "Extra headers: " << std::endl;
 
         for (const auto &header_value : request_header.header_values)
         {
@@ -34,6 +66,11 @@ struct web_request
 
         os << "Body: " << std::endl << request_header.body << std::endl;
 
+        for (const auto &part : request_header.parts)
+        {
+            os << "Part: " << part.name() << " (" << part.size << " bytes)" << std::endl;
+        }
+
         return os;
     }
 };
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+
+class response_stream;
+
 /**
  * \brief This struct is mostly set by the end user to send a response.
  * We default the status_code to 404 and the status to "Not Found".
@@ -14,13 +20,45 @@ struct web_response
     std::string protocol;
     std::string version;
     std::string content_type;
+    /**
+     * \brief Any extra headers to send, for example Cache-Control.
+     */
+    std::map<std::string, std::string> header_values;
     std::string body;
+    /**
+     * \brief If this is set the body is ignored and the response is streamed instead.
+     * The function is called once the headers were sent and can write to the stream for as long as it likes.
+     */
+    std::function<void(std::shared_ptr<response_stream>)> stream_function;
 
     inline std::string to_string()
+    {
+        return header_string("Content-Length: " + std::to_string(body.length())) + body;
+    }
+
+    /**
+     * \brief The status line and headers of a streamed response.
+     * HTTP/1.0 clients don't understand chunked bodies, so they get the raw body and the connection is closed at the
+     * end.
+     */
+    inline std::string stream_header_string()
+    {
+        return header_string(is_chunked() ? "Transfer-Encoding: chunked" : "Connection: close");
+    }
+
+    inline bool is_chunked() const
+    {
+        return version != "1.0";
+    }
+
+  private:
+    inline std::string header_string(const std::string &length_header)
     {
         std::string response = protocol + "/" + version + " " + std::to_string(status_code) + " " + status;
-        response += "\r\nServer: " + host + "\r\nContent-Type: " + content_type +
-                    "\r\nContent-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+        response += "\r\nServer: " + host + "\r\nContent-Type: " + content_type + "\r\n";
+        for (const auto &[key, value] : header_values)
+            response += key + ": " + value + "\r\n";
+        response += length_header + "\r\n\r\n";
 
         return response;
     }
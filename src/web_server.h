@@ -1,15 +1,28 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <thread>
 
 #include <asio.hpp>
 #include <asio/ts/internet.hpp>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "connection.h"
+#include "enums/priority.h"
+#include "listener_handoff.h"
+#include "load_shedder.h"
+#include "rate_limiter.h"
 
 /**
  * \brief This is the main class someone should use.
@@ -20,7 +33,8 @@ class web_server
   public:
     /**
      * \brief Constructor
-     * This will set up some asio stuff for the tcp-layer.
+     * This will set up some asio stuff for the tcp-layer. The port is bound in start(), unless adopt_listener() took
+     * over the listening socket of another process.
      * \param ip_address to listen on.
      * \param port to listen on.
      */
@@ -33,10 +47,10 @@ class web_server
     ~web_server() = default;
 
     /**
-     * \brief Calls the wait_for_client function.
+     * \brief Binds the port if no listening socket was adopted and calls the wait_for_client function.
      * Starts the context thread.
      * Starts a thread to delete stale connections.
-     * \return true if the server started.
+     * \return true if the server started, false if the constructor failed or the port couldn't be bound.
      */
     bool start();
     /**
@@ -45,15 +59,99 @@ class web_server
      * \param url The url the client must hit to call this method.
      * \param function A lambda that will be called once the METHOD and url is
      * hit.
+     * \param priority HIGH endpoints are still served when load shedding rejects the rest.
      */
     void register_function(METHODS method, const std::string &url,
-        const std::function<void(const web_request &, web_response &)> &function);
+        const std::function<void(const web_request &, web_response &)> &function,
+        PRIORITIES priority = PRIORITIES::NORMAL);
+    /**
+     * \brief Limits the amount of requests a single client ip-address can make.
+     * Call this before start(), the limits are read from the context thread without locking.
+     * \param limit The token bucket settings every client gets.
+     */
+    void set_client_rate_limit(const rate_limit &limit);
+    /**
+     * \brief Limits the amount of requests all clients together can make to a single endpoint.
+     * Call this before start().
+     * \param method Which HTTP Action the limit applies to.
+     * \param url The url the limit applies to.
+     * \param limit The token bucket settings of the endpoint.
+     */
+    void set_route_rate_limit(METHODS method, const std::string &url, const rate_limit &limit);
+    /**
+     * \brief Limits the amount of requests per api key.
+     * Requests without the header are not limited by this. Call this before start().
+     * \param header_name The header that contains the api key, for example "X-Api-Key".
+     * \param limit The token bucket settings every api key gets.
+     */
+    void set_api_key_rate_limit(const std::string &header_name, const rate_limit &limit);
+    /**
+     * \brief Rejects NORMAL priority requests with a 503 when requests keep waiting longer than the target to be
+     * handled.
+     * Call this before start().
+     */
+    void enable_load_shedding(const load_shedding_settings &settings = {});
+    /**
+     * \return How many requests were admitted and shed so far.
+     */
+    load_shedding_counters load_shedding_stats() const;
     /**
      * \brief Stops the io_context thread
+     * \param drain_timeout If this is more than 0 the server first stops accepting, closes the idle connections and
+     * waits up to drain_timeout for the requests that are busy to finish.
+     */
+    void stop(std::chrono::milliseconds drain_timeout = std::chrono::milliseconds(0));
+#ifndef _WIN32
+    /**
+     * \brief Takes over the listening socket of a running web_server instead of binding the port in start().
+     * Its unix domain sockets are taken over too and used by add_unix_listener() for the same paths.
+     * Call this before start(). The running server must have called serve_listener_handoff() with the same path.
+     * \param handoff_path The unix socket the running server is waiting on.
+     * \return true if the listening socket was received.
+     */
+    bool adopt_listener(const std::string &handoff_path);
+    /**
+     * \brief Waits on a unix socket for a new process to take over the listening socket and the unix domain sockets.
+     * Once they have been handed over this server stops accepting, closes its idle connections and handed_off() returns
+     * true. The socket files then belong to the new process and are not deleted by stop().
+     * The new process should call adopt_listener() first and only then serve_listener_handoff() itself.
+     * The sockets are only handed to processes of the same user.
+     * \param handoff_path The unix socket to create.
+     * \return true if the unix socket was created.
+     */
+    bool serve_listener_handoff(const std::string &handoff_path);
+    /**
+     * \brief Also listens on a unix domain socket, serving the same endpoints as TCP.
+     * Local clients skip the TCP stack and requests get the peer's pid, uid and gid in web_request::peer.
+     * The socket is served in plaintext, also when OPEN_SSL is defined. Call this before start().
+     * If adopt_listener() received a socket for path, that socket is used as is, with the permissions it already has.
+     * \param path The socket file to create, or a name starting with '@' for a Linux abstract socket.
+     * \param permissions Who may connect to the socket file. Abstract sockets have no file and ignore this.
+     * \return true if the socket is listening.
+     */
+    bool add_unix_listener(const std::string &path,
+        std::filesystem::perms permissions = std::filesystem::perms::owner_read | std::filesystem::perms::owner_write |
+                                             std::filesystem::perms::group_read | std::filesystem::perms::group_write);
+#endif
+    /**
+     * \return true once a new process has taken over the listening socket.
      */
-    void stop();
+    bool handed_off() const;
+#ifdef REQUEST_TRACING
+    /**
+     * \brief Changes the sampling rate, slow request threshold and output file of the request tracer.
+     * Call this before start(). The kept traces are written to the output file every second and on stop().
+     */
+    void configure_tracing(const trace_settings &settings);
+#endif
 
   protected:
+    /**
+     * \brief Binds the port and creates the acceptor.
+     * \return false if the constructor failed or the port couldn't be bound.
+     */
+    bool listen();
+
     /**
      * \brief Waits for clients to connect.
      * When a client connects, we create a connection object and add it to the
@@ -61,6 +159,66 @@ class web_server
      */
     void wait_for_client();
 
+    /**
+     * \brief Sets a timer every probe_every and records how late its handler runs.
+     * This is the queueing delay load shedding acts on.
+     */
+    void probe_queue_delay();
+
+    /**
+     * \brief Reads the client's address and hands the socket to add_connection.
+     */
+    void add_tcp_connection(asio::ip::tcp::socket socket);
+
+    /**
+     * \brief Creates a connection for a newly accepted client and adds it to the _connections vector.
+     * \param tls false to serve the client in plaintext even when OPEN_SSL is defined.
+     */
+    void add_connection(connection::socket_type socket, std::string remote_address,
+        std::optional<peer_credentials> peer = std::nullopt, bool tls = true);
+#ifndef _WIN32
+    /**
+     * \brief The same as wait_for_client but for a unix domain socket.
+     */
+    void wait_for_unix_client(asio::local::stream_protocol::acceptor &acceptor);
+
+    /**
+     * \brief Asks the kernel who is on the other side of a unix domain socket.
+     */
+    static std::optional<peer_credentials> get_peer_credentials(int fd);
+
+    /**
+     * \brief Waits for a new process to connect to the handoff socket and sends it the listening socket.
+     */
+    void wait_for_handoff();
+
+    /**
+     * \brief Deletes a socket file that a previous process left behind.
+     * \return false if something other than a socket is in the way, it is left alone.
+     */
+    static bool remove_stale_socket(const std::string &path);
+#endif
+
+    /**
+     * \brief Checks the request against the client, route and api key rate limits.
+     * A token is only taken from the buckets if none of the limits were hit.
+     * \return The preserialized 429 response if any limit was hit, otherwise nullptr.
+     */
+    const std::string *check_rate_limits(const web_request &request);
+
+    /**
+     * \brief Checks the rate limits and, if the server is overloaded, the priority of the endpoint.
+     * \return The preserialized response to reject the request with, otherwise nullptr.
+     */
+    const std::string *check_admission(const web_request &request);
+
+    /**
+     * \brief Stops accepting new clients, closes the connections that are waiting for a request and ends the open
+     * streams.
+     * Must be called from the context thread.
+     */
+    void stop_accepting();
+
   private:
     /**
      * \brief The IpAddress the server is listening on.
@@ -73,7 +231,11 @@ class web_server
     /**
      * \brief Whether or not the server should shut down.
      */
-    bool _shutdown = false;
+    std::atomic<bool> _shutdown = false;
+    /**
+     * \brief False if the constructor failed to set up the endpoint or the certificates, the server must not start.
+     */
+    bool _configured = false;
 
     std::string _certificate_file;
     std::string _key_file;
@@ -103,6 +265,68 @@ class web_server
      * \brief The list is changed in a thread so we have to be thread safe.
      */
     std::mutex _connection_mutex;
+
+    rate_limit _client_rate_limit;
+    /**
+     * \brief The limit of every url per method, next to its bucket key so a request doesn't have to build the key.
+     */
+    std::map<METHODS, std::map<std::string, std::pair<std::string, rate_limit>>> _route_rate_limits;
+    std::string _api_key_header;
+    rate_limit _api_key_rate_limit;
+    /**
+     * \brief Buckets keyed by client ip-address.
+     */
+    rate_limiter _client_limiter;
+    /**
+     * \brief Buckets keyed by "METHOD url".
+     */
+    rate_limiter _route_limiter;
+    /**
+     * \brief Buckets keyed by api key.
+     */
+    rate_limiter _api_key_limiter;
+
+    bool _load_shedding_enabled = false;
+    load_shedding_settings _load_shedding_settings;
+    load_shedder _load_shedder;
+    std::unique_ptr<asio::steady_timer> _probe_timer;
+    /**
+     * \brief The endpoints that are registered with PRIORITIES::HIGH.
+     */
+    std::map<METHODS, std::set<std::string>> _high_priority_routes;
+
+#ifndef _WIN32
+    std::string _handoff_path;
+    std::unique_ptr<asio::local::stream_protocol::acceptor> _handoff_acceptor;
+    /**
+     * \brief A unix domain socket the server listens on next to TCP.
+     */
+    struct unix_listener
+    {
+        /**
+         * \brief The path it was created with, starting with '@' for an abstract socket.
+         */
+        std::string path;
+        std::unique_ptr<asio::local::stream_protocol::acceptor> acceptor;
+        /**
+         * \brief The socket file that was bound, stop() leaves the path alone if another file has replaced it.
+         * The inode may be reused by a file that was bound after ours was deleted, so this is no substitute for the
+         * handoff, which passes the socket on instead.
+         */
+        dev_t device = 0;
+        ino_t inode = 0;
+    };
+    std::vector<unix_listener> _unix_acceptors;
+    /**
+     * \brief The unix domain sockets adopt_listener() received, by path, until add_unix_listener() picks them up.
+     */
+    std::map<std::string, int> _adopted_unix_listeners;
+#endif
+    std::atomic<bool> _handed_off = false;
+
+#ifdef REQUEST_TRACING
+    request_tracer _tracer;
+#endif
 };
 
 inline web_server::web_server(const std::string_view ip_address, const short port,
@@ -121,6 +345,21 @@ inline web_server::web_server(const std::string_view ip_address, const short por
         _io_context.use_private_key_file(_key_file, asio::ssl::context::pem);
 #endif
         _endpoint = asio::ip::tcp::endpoint(asio::ip::make_address(_ip_address), _port);
+        _configured = true;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "[web_server] Error: " << e.what() << std::endl;
+    }
+}
+
+inline bool web_server::listen()
+{
+    if (!_configured)
+        return false;
+
+    try
+    {
         _acceptor = std::make_unique<asio::ip::tcp::acceptor>(_basic_context, _endpoint);
         const auto option = asio::socket_base::reuse_address(true);
         std::error_code ec;
@@ -133,14 +372,40 @@ inline web_server::web_server(const std::string_view ip_address, const short por
     catch (const std::exception &e)
     {
         std::cerr << "[web_server] Error: " << e.what() << std::endl;
+        _acceptor.reset();
+        return false;
     }
+
+    return true;
 }
 
 inline bool web_server::start()
 {
+    // Otherwise it would listen on every interface on a random port, and without certificates.
+    if (!_configured)
+    {
+        std::cerr << "[web_server] Error: not starting, the server wasn't set up correctly" << std::endl;
+        return false;
+    }
+
+    // A listening socket that was taken over from another process is used as is, binding would fail anyway.
+    if (!_acceptor && !listen())
+        return false;
+#ifndef _WIN32
+    // Unix domain sockets of the previous process that this one doesn't listen on, nobody would accept their clients.
+    for (const auto &[path, fd] : _adopted_unix_listeners)
+        ::close(fd);
+    _adopted_unix_listeners.clear();
+#endif
+
     try
     {
         wait_for_client();
+        if (_load_shedding_enabled)
+        {
+            _probe_timer = std::make_unique<asio::steady_timer>(_basic_context);
+            probe_queue_delay();
+        }
         _context_thread = std::thread(
             [&]()
             {
@@ -160,8 +425,18 @@ inline bool web_server::start()
         _delete_connections_thread = std::thread(
             [&]()
             {
+#ifdef REQUEST_TRACING
+                auto next_export = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+#endif
                 while (!_shutdown)
                 {
+#ifdef REQUEST_TRACING
+                    if (std::chrono::steady_clock::now() >= next_export)
+                    {
+                        _tracer.export_otlp_json();
+                        next_export += std::chrono::seconds(1);
+                    }
+#endif
                     try
                     {
                         if (!_connections.empty())
@@ -173,7 +448,7 @@ inline bool web_server::start()
                                                        if (connection)
                                                        {
                                                            std::cout << "Closing the connection? " << connection->close_me << '\n';
-                                                           return connection->close_me;
+                                                           return connection->close_me.load();
                                                        }
                                                        return false;
                                                    }),
@@ -199,13 +474,136 @@ inline bool web_server::start()
 }
 
 inline void web_server::register_function(const METHODS method, const std::string &url,
-    const std::function<void(const web_request &, web_response &)> &function)
+    const std::function<void(const web_request &, web_response &)> &function, const PRIORITIES priority)
 {
     _functions[method].push_back(std::make_pair(url, function));
+    if (priority == PRIORITIES::HIGH)
+        _high_priority_routes[method].insert(url);
+    else
+        _high_priority_routes[method].erase(url);
+}
+
+inline void web_server::set_client_rate_limit(const rate_limit &limit)
+{
+    _client_rate_limit = limit;
+}
+
+inline void web_server::set_route_rate_limit(const METHODS method, const std::string &url, const rate_limit &limit)
+{
+    _route_rate_limits[method][url] = std::make_pair(methods::method_to_string(method) + " " + url, limit);
+}
+
+inline void web_server::set_api_key_rate_limit(const std::string &header_name, const rate_limit &limit)
+{
+    _api_key_header = header_name;
+    _api_key_rate_limit = limit;
+}
+
+#ifdef REQUEST_TRACING
+inline void web_server::configure_tracing(const trace_settings &settings)
+{
+    _tracer.configure(settings);
+}
+#endif
+
+inline void web_server::enable_load_shedding(const load_shedding_settings &settings)
+{
+    _load_shedding_settings = settings;
+    _load_shedder.configure(settings);
+    _load_shedding_enabled = true;
+}
+
+inline load_shedding_counters web_server::load_shedding_stats() const
+{
+    return _load_shedder.counters();
+}
+
+inline const std::string *web_server::check_admission(const web_request &request)
+{
+    if (const auto *rejection = check_rate_limits(request))
+        return rejection;
+
+    if (_load_shedding_enabled)
+    {
+        const auto routes = _high_priority_routes.find(request.method);
+        const auto priority = routes != _high_priority_routes.end() && routes->second.count(request.url) != 0
+                                  ? PRIORITIES::HIGH
+                                  : PRIORITIES::NORMAL;
+        if (!_load_shedder.admit(priority))
+            return &_load_shedder.rejection_response();
+    }
+
+    return nullptr;
 }
 
-inline void web_server::stop()
+inline const std::string *web_server::check_rate_limits(const web_request &request)
 {
+    const auto now = rate_limiter::clock::now();
+
+    const std::string *route_key = nullptr;
+    const rate_limit *route_limit = nullptr;
+    if (const auto method_limits = _route_rate_limits.find(request.method); method_limits != _route_rate_limits.end())
+    {
+        if (const auto limit = method_limits->second.find(request.url); limit != method_limits->second.end())
+        {
+            route_key = &limit->second.first;
+            route_limit = &limit->second.second;
+        }
+    }
+
+    const std::string *api_key = nullptr;
+    if (!_api_key_header.empty())
+    {
+        if (const auto header = request.header_values.find(_api_key_header); header != request.header_values.end())
+            api_key = &header->second;
+    }
+
+    // Every bucket is checked before a token is taken from any of them, otherwise a request that is rejected by the
+    // route or api key limit would still use up the client's quota.
+    // Only the context thread calls this, so nothing can take the tokens between the check and the take.
+    if (!_client_limiter.can_acquire(request.remote_address, _client_rate_limit, now) ||
+        (route_limit && !_route_limiter.can_acquire(*route_key, *route_limit, now)) ||
+        (api_key && !_api_key_limiter.can_acquire(*api_key, _api_key_rate_limit, now)))
+        return &too_many_requests_response;
+
+    _client_limiter.try_acquire(request.remote_address, _client_rate_limit, now);
+    if (route_limit)
+        _route_limiter.try_acquire(*route_key, *route_limit, now);
+    if (api_key)
+        _api_key_limiter.try_acquire(*api_key, _api_key_rate_limit, now);
+
+    return nullptr;
+}
+
+inline void web_server::stop(const std::chrono::milliseconds drain_timeout)
+{
+    if (drain_timeout.count() > 0 && _context_thread.joinable())
+    {
+        asio::post(_basic_context, [&]() { stop_accepting(); });
+
+        const auto deadline = std::chrono::steady_clock::now() + drain_timeout;
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            {
+                std::lock_guard<std::mutex> guard(_connection_mutex);
+                if (std::all_of(_connections.begin(), _connections.end(),
+                        [](const std::shared_ptr<connection> &c) { return !c || c->close_me; }))
+                    break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    {
+        // Handlers may still hold streams, their writes must fail once the context is stopped.
+        std::lock_guard<std::mutex> guard(_connection_mutex);
+        for (const auto &c : _connections)
+        {
+            if (c)
+                c->abort_stream();
+        }
+    }
+
     _shutdown = true;
     _basic_context.stop();
     if (_context_thread.joinable())
@@ -213,45 +611,368 @@ inline void web_server::stop()
     _connections.clear();
     if (_delete_connections_thread.joinable())
         _delete_connections_thread.join();
+#ifdef REQUEST_TRACING
+    _tracer.export_otlp_json();
+#endif
+#ifndef _WIN32
+    if (_handoff_acceptor && _handoff_acceptor->is_open())
+        ::unlink(_handoff_path.c_str());
+    // After a handoff the new process is listening on the same socket files.
+    for (const auto &listener : _unix_acceptors)
+    {
+        struct stat status;
+        if (!_handed_off && listener.path.front() != '@' && ::stat(listener.path.c_str(), &status) == 0 &&
+            status.st_dev == listener.device && status.st_ino == listener.inode)
+            ::unlink(listener.path.c_str());
+    }
+#endif
 
     std::cout << "[web_server] Stopped..." << std::endl;
 }
 
+inline void web_server::stop_accepting()
+{
+    asio::error_code ec;
+    if (_acceptor && _acceptor->is_open())
+        _acceptor->close(ec);
+#ifndef _WIN32
+    for (const auto &listener : _unix_acceptors)
+        listener.acceptor->close(ec);
+#endif
+
+    std::lock_guard<std::mutex> guard(_connection_mutex);
+    for (const auto &c : _connections)
+    {
+        if (c)
+        {
+            c->close_if_idle();
+            // Streams such as SSE don't end on their own, without this the drain would always wait for the deadline.
+            c->close_stream();
+        }
+    }
+}
+
+#ifndef _WIN32
+inline bool web_server::adopt_listener(const std::string &handoff_path)
+{
+    asio::local::stream_protocol::socket handoff_socket(_basic_context);
+    asio::error_code ec;
+    handoff_socket.connect(asio::local::stream_protocol::endpoint(handoff_path), ec);
+    if (ec)
+    {
+        std::cerr << "[web_server] Error connecting to " << handoff_path << ": " << ec.message() << std::endl;
+        return false;
+    }
+
+    const auto fd = handoff::receive_fd(handoff_socket.native_handle());
+    if (fd < 0)
+    {
+        std::cerr << "[web_server] Error: no listening socket was received from " << handoff_path << std::endl;
+        return false;
+    }
+
+    _acceptor = std::make_unique<asio::ip::tcp::acceptor>(_basic_context);
+    _acceptor->assign(_endpoint.protocol(), fd, ec);
+    if (ec)
+    {
+        std::cerr << "[web_server] Error adopting the listening socket: " << ec.message() << std::endl;
+        ::close(fd);
+        _acceptor.reset();
+        return false;
+    }
+
+    // The unix domain sockets follow until the running server closes the connection.
+    std::string path;
+    for (auto unix_fd = handoff::receive_fd(handoff_socket.native_handle(), &path); unix_fd >= 0;
+         unix_fd = handoff::receive_fd(handoff_socket.native_handle(), &path))
+    {
+        if (const auto [adopted, inserted] = _adopted_unix_listeners.emplace(path, unix_fd); !inserted)
+            ::close(unix_fd);
+    }
+
+    std::cout << "[web_server] Took over the listening socket from " << handoff_path << std::endl;
+    return true;
+}
+
+inline bool web_server::serve_listener_handoff(const std::string &handoff_path)
+{
+    try
+    {
+        _handoff_path = handoff_path;
+        // A previous process that crashed may have left the socket behind.
+        if (!remove_stale_socket(_handoff_path))
+            return false;
+        _handoff_acceptor = std::make_unique<asio::local::stream_protocol::acceptor>(
+            _basic_context, asio::local::stream_protocol::endpoint(_handoff_path));
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "[web_server] Error: " << e.what() << std::endl;
+        return false;
+    }
+
+    wait_for_handoff();
+    return true;
+}
+
+inline void web_server::wait_for_handoff()
+{
+    _handoff_acceptor->async_accept(
+        [&](const std::error_code ec, asio::local::stream_protocol::socket peer)
+        {
+            if (ec)
+            {
+                if (ec != asio::error::operation_aborted)
+                    std::cerr << "[web_server] Error with handoff connection: " << ec.message() << std::endl;
+                return;
+            }
+
+            // Whoever can reach the socket file would otherwise be able to take over the port.
+            const auto credentials = get_peer_credentials(peer.native_handle());
+            if (!credentials || credentials->uid != ::geteuid())
+            {
+                std::cerr << "[web_server] Error: refused to hand the listening socket to another user" << std::endl;
+                wait_for_handoff();
+                return;
+            }
+
+            // The new process binds the same path once it has the socket, so let go of it before sending.
+            asio::error_code close_ec;
+            _handoff_acceptor->close(close_ec);
+            ::unlink(_handoff_path.c_str());
+
+            if (!_acceptor || !handoff::send_fd(peer.native_handle(), _acceptor->native_handle()))
+            {
+                serve_listener_handoff(_handoff_path);
+                return;
+            }
+            // The socket files stay where they are, so unix clients aren't refused while the new process starts either.
+            for (const auto &listener : _unix_acceptors)
+            {
+                if (!handoff::send_fd(peer.native_handle(), listener.acceptor->native_handle(), listener.path))
+                    std::cerr << "[web_server] Error: " << listener.path << " wasn't handed over" << std::endl;
+            }
+
+            // The new process has its own copy of the socket, closing ours doesn't refuse anything.
+            stop_accepting();
+            _handed_off = true;
+            std::cout << "[web_server] Handed the listening socket over, draining..." << std::endl;
+        });
+}
+
+inline bool web_server::remove_stale_socket(const std::string &path)
+{
+    struct stat status;
+    if (::lstat(path.c_str(), &status) != 0)
+        return true;
+
+    if (!S_ISSOCK(status.st_mode))
+    {
+        std::cerr << "[web_server] Error: " << path << " exists and is not a socket" << std::endl;
+        return false;
+    }
+
+    ::unlink(path.c_str());
+    return true;
+}
+#endif
+
+inline bool web_server::handed_off() const
+{
+    return _handed_off;
+}
+
 inline void web_server::wait_for_client()
 {
     _acceptor->async_accept(
         [&](const std::error_code ec, asio::ip::tcp::socket socket)
         {
-            socket.set_option(asio::socket_base::reuse_address(true));
             if (!ec)
             {
+                add_tcp_connection(std::move(socket));
+                wait_for_client();
+            }
+            else if (ec != asio::error::operation_aborted)
+            {
+                std::cerr << "[web_server] Error with client connection: " << ec.message() << std::endl;
+            }
+        });
+}
+
+inline void web_server::probe_queue_delay()
+{
+    const auto due = load_shedder::clock::now() + _load_shedding_settings.probe_every;
+    _load_shedder.probe_scheduled(due);
+    _probe_timer->expires_at(due);
+    _probe_timer->async_wait(
+        [&, due](const std::error_code ec)
+        {
+            if (ec)
+                return;
+
+            // The handler of an expired timer waits behind everything that was ready before it, so how late it runs is
+            // the queueing delay.
+            _load_shedder.record_sojourn(load_shedder::clock::now() - due);
+            probe_queue_delay();
+        });
+}
+
+inline void web_server::add_tcp_connection(asio::ip::tcp::socket socket)
+{
+    socket.set_option(asio::socket_base::reuse_address(true));
+    asio::error_code endpoint_ec;
+    const auto remote_endpoint = socket.remote_endpoint(endpoint_ec);
+    auto remote_address = endpoint_ec ? std::string() : remote_endpoint.address().to_string();
+    add_connection(connection::socket_type(std::move(socket)), std::move(remote_address));
+}
+
+inline void web_server::add_connection(connection::socket_type socket, std::string remote_address,
+    std::optional<peer_credentials> peer, [[maybe_unused]] const bool tls)
+{
 #ifdef OPEN_SSL
-                auto new_connection = std::make_shared<connection>(
-                    asio::ssl::stream<asio::ip::tcp::socket>(std::move(socket), _io_context));
+    auto new_connection =
+        std::make_shared<connection>(asio::ssl::stream<connection::socket_type>(std::move(socket), _io_context),
+            std::move(remote_address), peer, tls);
 #else
-                auto new_connection = std::make_shared<connection>(std::move(socket));
+    auto new_connection = std::make_shared<connection>(std::move(socket), std::move(remote_address), peer);
 #endif
-                new_connection->done_reading_function = [&](const web_request &request, web_response &response)
+    new_connection->done_reading_function = [&](const web_request &request, web_response &response)
+    {
+        if (_functions.find(request.method) != _functions.end())
+        {
+            for (const auto &[url, function] : _functions[request.method])
+            {
+                if (request.url == url)
                 {
-                    if (_functions.find(request.method) != _functions.end())
-                    {
-                        for (const auto &[url, function] : _functions[request.method])
-                        {
-                            if (request.url == url)
-                            {
-                                function(request, response);
-                                break;
-                            }
-                        }
-                    }
-                };
-                std::lock_guard<std::mutex> guard(_connection_mutex);
-                _connections.emplace_back(new_connection);
-                wait_for_client();
+                    function(request, response);
+                    break;
+                }
+            }
+        }
+    };
+    new_connection->reject_function = [&](const web_request &request) { return check_admission(request); };
+#ifdef REQUEST_TRACING
+    new_connection->trace_function = [&](const request_trace &trace) { _tracer.record(trace); };
+#endif
+    std::lock_guard<std::mutex> guard(_connection_mutex);
+    _connections.emplace_back(new_connection);
+}
+
+#ifndef _WIN32
+inline bool web_server::add_unix_listener(const std::string &path, const std::filesystem::perms permissions)
+{
+    if (path.empty())
+        return false;
+
+    const auto abstract = path.front() == '@';
+    try
+    {
+        unix_listener listener;
+        listener.path = path;
+        if (const auto adopted = _adopted_unix_listeners.find(path); adopted != _adopted_unix_listeners.end())
+        {
+            const auto fd = adopted->second;
+            _adopted_unix_listeners.erase(adopted);
+            listener.acceptor = std::make_unique<asio::local::stream_protocol::acceptor>(_basic_context);
+            asio::error_code ec;
+            listener.acceptor->assign(asio::local::stream_protocol(), fd, ec);
+            if (ec)
+            {
+                std::cerr << "[web_server] Error adopting " << path << ": " << ec.message() << std::endl;
+                ::close(fd);
+                return false;
             }
-            else
+
+            struct stat status;
+            if (!abstract && ::stat(path.c_str(), &status) == 0)
             {
-                std::cerr << "[web_server] Error with client connection: " << ec.message() << std::endl;
+                listener.device = status.st_dev;
+                listener.inode = status.st_ino;
+            }
+        }
+        else if (abstract)
+        {
+            // Abstract sockets start with a null byte and don't exist on the file system.
+            listener.acceptor = std::make_unique<asio::local::stream_protocol::acceptor>(
+                _basic_context, asio::local::stream_protocol::endpoint(std::string(1, '\0') + path.substr(1)));
+        }
+        else
+        {
+            // A previous process that crashed, or the one we are replacing, may have left the socket behind.
+            if (!remove_stale_socket(path))
+                return false;
+
+            listener.acceptor = std::make_unique<asio::local::stream_protocol::acceptor>(_basic_context);
+            listener.acceptor->open(asio::local::stream_protocol());
+            // Bind while only the owner can connect and widen the permissions before listening, so the socket is never
+            // reachable with the umask's permissions. umask is process wide, call this before starting other threads.
+            const auto previous_mask = ::umask(S_IRWXG | S_IRWXO);
+            asio::error_code ec;
+            listener.acceptor->bind(asio::local::stream_protocol::endpoint(path), ec);
+            ::umask(previous_mask);
+            if (ec)
+            {
+                std::cerr << "[web_server] Error listening on " << path << ": " << ec.message() << std::endl;
+                return false;
+            }
+            std::filesystem::permissions(path, permissions);
+
+            struct stat status;
+            if (::stat(path.c_str(), &status) == 0)
+            {
+                listener.device = status.st_dev;
+                listener.inode = status.st_ino;
+            }
+            listener.acceptor->listen();
+        }
+
+        auto *acceptor = listener.acceptor.get();
+        _unix_acceptors.push_back(std::move(listener));
+        asio::post(_basic_context, [this, acceptor]() { wait_for_unix_client(*acceptor); });
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "[web_server] Error listening on " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    std::cout << "[web_server] Listening on unix socket: " << path << std::endl;
+    return true;
+}
+
+inline void web_server::wait_for_unix_client(asio::local::stream_protocol::acceptor &acceptor)
+{
+    acceptor.async_accept(
+        [&](const std::error_code ec, asio::local::stream_protocol::socket socket)
+        {
+            if (!ec)
+            {
+                const auto peer = get_peer_credentials(socket.native_handle());
+                auto remote_address = peer ? "unix:" + std::to_string(peer->pid) : std::string("unix");
+                // The peer credentials already say who the client is, TLS would only add a handshake to every request.
+                add_connection(connection::socket_type(std::move(socket)), std::move(remote_address), peer, false);
+                wait_for_unix_client(acceptor);
+            }
+            else if (ec != asio::error::operation_aborted)
+            {
+                std::cerr << "[web_server] Error with unix client connection: " << ec.message() << std::endl;
             }
         });
 }
+
+inline std::optional<peer_credentials> web_server::get_peer_credentials(const int fd)
+{
+#ifdef __linux__
+    ucred credentials{};
+    socklen_t length = sizeof(credentials);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+        return peer_credentials{credentials.pid, credentials.uid, credentials.gid};
+#else
+    uid_t uid;
+    gid_t gid;
+    if (::getpeereid(fd, &uid, &gid) == 0)
+        return peer_credentials{-1, uid, gid};
+#endif
+    return std::nullopt;
+}
+#endif